@@ -107,9 +107,13 @@ int main(int argc, char** argv)
 			  << ", opening files from " << nstart << " to " << nend
 			  << " ( " << fpp << " ) " << std::endl;
 
+	// with dCP harmonics, points are taken with dCP varied first, so that
+	// the harmonics of each set of masses and angles are computed once
+	std::string fastest = as->UseHarmonics() ? "CP" : "";
+
 	for (int i = nstart; i < nend; ++i)
 	{
-		Point = i;
+		Point = parms->GetOrderedEntry(i, fastest);
 		parms->GetEntry(Point, M12, M23, S12, S13, S23, dCP);
 
 		if (kVerbosity) {
@@ -134,6 +138,11 @@ int main(int argc, char** argv)
 		atmoT->Fill();
 	}
 
+	if (kVerbosity && as->UseHarmonics())
+		std::cout << "Atmo_input: dCP harmonics found cached in "
+			  << as->HarmonicsUsage().second << " of "
+			  << as->HarmonicsUsage().first << " calls" << std::endl;
+
 	std::cout << "Atmo_input: Finished and out" << std::endl;
 
 	outf->cd();
@@ -50,11 +50,13 @@ int main(int argc, char** argv)
 			// the Honda model, but it depends on the neutrino
 			// flavour and its energy
 			// Oscillator::Profile pp = atm->MatterProfile(Nu::E_, cosz, energy);
+			// see comments on app/beam_oscillation.cpp
+			Eigen::MatrixXd pm = osc->ProbabilityMatrix(Nu::E_, energy);
 			out << cosz << "\t" << energy << "\t";
-			out << osc->Probability(Nu::E_, Nu::E_, energy) << "\t";
-			out << osc->Probability(Nu::M_, Nu::E_, energy) << "\t";
-			out << osc->Probability(Nu::E_, Nu::M_, energy) << "\t";
-			out << osc->Probability(Nu::M_, Nu::M_, energy) << "\n";
+			out << pm(Nu::E_, Nu::E_) << "\t";
+			out << pm(Nu::E_, Nu::M_) << "\t";
+			out << pm(Nu::M_, Nu::E_) << "\t";
+			out << pm(Nu::M_, Nu::M_) << "\n";
 		}
 	}
 
@@ -44,11 +44,14 @@ int main(int argc, char** argv)
 	// to a text file
 	std::ofstream out(output.c_str());
 	for (double energy = 0; energy <= 10; energy += 0.002) {
+		// all neutrino channels from one propagation,
+		// element (out, in) is the probability in -> out
+		Eigen::MatrixXd pm = osc->ProbabilityMatrix(Nu::E_, energy);
 		out << energy << "\t";
-		out << osc->Probability(Nu::E_, Nu::E_, energy) << "\t";
-		out << osc->Probability(Nu::M_, Nu::E_, energy) << "\t";
-		out << osc->Probability(Nu::E_, Nu::M_, energy) << "\t";
-		out << osc->Probability(Nu::M_, Nu::M_, energy) << "\n";
+		out << pm(Nu::E_, Nu::E_) << "\t";
+		out << pm(Nu::E_, Nu::M_) << "\t";
+		out << pm(Nu::M_, Nu::E_) << "\t";
+		out << pm(Nu::M_, Nu::M_) << "\n";
 	}
 
 	out.close();
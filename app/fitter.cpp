@@ -181,15 +181,20 @@ int main(int argc, char** argv)
 
 	auto t_start = std::chrono::high_resolution_clock::now();
 
+	// with dCP harmonics, points are taken with dCP varied first, so that
+	// the harmonics of each set of masses and angles are computed once
+	std::string fastest = fitter->UseHarmonics() ? "CP" : "";
+
 	if (argc > 4) {
 		nstart = std::stoi(argv[4]);
 		nend = nstart + 1;
+		fastest = "";
 		std::cout << "Fitter: OVERRIDE fitting only point " << nstart << "\n";
 	}
 		
 	for (int i = nstart; i < nend; ++i)
 	{
-		Point = i;
+		Point = parms->GetOrderedEntry(i, fastest);
 		parms->GetEntry(Point, M12, M23, S12, S13, S23, dCP);
 
 		double PenX2 = parms->GetPenalty(Point);
@@ -319,6 +324,11 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (kVerbosity && fitter->UseHarmonics())
+		std::cout << "Fitter: dCP harmonics found cached in "
+			  << fitter->HarmonicsUsage().second << " of "
+			  << fitter->HarmonicsUsage().first << " calls" << std::endl;
+
 	std::cout << "Fitter: Finished and out" << std::endl;
 
 	outf->cd();
@@ -76,11 +76,12 @@ int main(int argc, char** argv)
         //start filling in output
         std::ofstream fout(outputprob.c_str());
         for (double energy = 0; energy <= 10; energy += 0.002) {
+                Eigen::MatrixXd pm = osc->ProbabilityMatrix(Nu::E_, energy);
                 fout << energy << "\t"
-                     << osc->Probability(Nu::E_, Nu::E_, energy) << "\t"
-                     << osc->Probability(Nu::M_, Nu::E_, energy) << "\t"
-                     << osc->Probability(Nu::E_, Nu::M_, energy) << "\t"
-                     << osc->Probability(Nu::M_, Nu::M_, energy) << "\n";
+                     << pm(Nu::E_, Nu::E_) << "\t"
+                     << pm(Nu::E_, Nu::M_) << "\t"
+                     << pm(Nu::M_, Nu::E_) << "\t"
+                     << pm(Nu::M_, Nu::M_) << "\n";
         }
 
 
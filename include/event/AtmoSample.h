@@ -12,9 +12,10 @@
  *   2) using the 4D tensors the class builds the atmospheric observables
  *      given a combination of oscillation parameters
  *
- * The tensors are saved as two T2HD object for easy binning and one Eigen::MatrixXd
- * that stores the content of the tensor, already flattened out.
- * The global index of each of the T2HD object is related to rows and cols of the matrix object
+ * The tensors are stored as sparse matrices, one per oscillation channel, from
+ * true bins (columns) to the flattened reco spectra (rows), and they are cached
+ * in a binary file. They are used only if response_tensor is set in the card,
+ * otherwise the observables are built event by event
  * 
  */
 
@@ -23,9 +24,18 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <set>
+#include <random>
+#include <thread>
+#include <exception>
+#include <fstream>
+#include <numeric>
+#include <tuple>
+#include <algorithm>
 
 #include "physics/Atmosphere.h"
+#include "physics/Oscillogram.h"
 
 #include "event/Sample.h"
 
@@ -51,18 +61,92 @@ class AtmoSample : public Sample
 		std::unordered_map<std::string, Eigen::VectorXd>
 			BuildSamples(std::shared_ptr<Oscillator> osc = nullptr) override;
 		Eigen::VectorXd ConstructSamples(std::shared_ptr<Oscillator> osc = nullptr);
+		std::unordered_map<std::string, Eigen::MatrixXd>
+			BuildJacobians(std::shared_ptr<Oscillator> osc) override;
 		virtual std::unordered_map<std::string, Eigen::VectorXd>
 			Unfold(const Eigen::VectorXd &En);
 
 
 	private:
+		bool LoadEvent(int i, std::string &type, int &bin);
+		void FluxFactors(double &factor_E, double &factor_M);
+		Eigen::VectorXd FillEvents(std::shared_ptr<Oscillator> osc);
+		size_t FillParallel(std::shared_ptr<Oscillator> osc, Eigen::VectorXd &spectra);
+		void FillSpectra(const Oscillator *osc, size_t begin, size_t end,
+				 Eigen::VectorXd &spectra, size_t &changes) const;
+		double Oscillated(size_t i, const Eigen::MatrixXd &pm) const;
+		const Atmosphere::Profiles &EventProfiles(size_t i,
+							  Atmosphere::Profiles &own) const;
+		Eigen::MatrixXd Averaged(Oscillator &osc, Nu::Flavor nu, double energy,
+					 size_t &changes, const Atmosphere::Profiles &profiles,
+					 bool same = false) const;
+		Eigen::MatrixXd Averaged(const Oscillator &osc, Oscillator::Context &ctx,
+					 Nu::Flavor nu, double energy, size_t &changes,
+					 const Atmosphere::Profiles &profiles, bool same = false) const;
+		Eigen::MatrixXd Averaged(Oscillator &osc, Nu::Flavor nu, double energy,
+					 size_t &changes, const std::vector<std::pair<double, int> > &cells,
+					 int &current) const;
+		Eigen::MatrixXd Averaged(const Oscillator &osc, Oscillator::Context &ctx,
+					 Nu::Flavor nu, double energy, size_t &changes,
+					 const std::vector<std::pair<double, int> > &cells,
+					 int &current) const;
+		void SortEvents();
+
+		// response matrices, built from the events or read from file
+		void BuildResponse();
+		bool ReadResponse();
+		void WriteResponse() const;
+		Eigen::VectorXd ResponseSpectra(std::shared_ptr<Oscillator> osc);
+		int ResponseChannel(Nu::Flavor in, Nu::Flavor out) const;
+
+		// selected events of the simulation, read once by LoadSimulation
+		// with one array per variable, weights are already scaled
+		struct Events {
+			std::vector<float> pnu, cosz;	// true neutrino
+			std::vector<float> weight, factor_E, factor_M;
+			std::vector<int> bin;		// position in flattened spectra
+			std::vector<char> flavor, nc;	// Nu::Flavor and NC flag
+			std::vector<int> entry;		// in the simulation files
+			std::vector<int> profile;	// in _profiles, if sorted
+
+			size_t size() const { return pnu.size(); }
+		};
+		Events _events;
+
 		// atmospheric oscillation
 		std::unique_ptr<Atmosphere> _atm_path;
+		// table of probabilities, used instead of exact propagation
+		std::unique_ptr<Oscillogram> _oscillogram;
+		bool kOscillogramChecked;
+		// number of threads for the event loop
+		int _threads;
+		// key of the random streams of production heights
+		int _seed;
+
+		// events sorted by flavour, bucket of cosz, and energy, with
+		// matter profiles of each flavour and bucket, 0 if not sorted
+		int _buckets;
+		std::vector<Atmosphere::Profiles> _profiles;
+
+		// linear response from true bins in log10 E and cosz to the
+		// flattened spectra, one sparse matrix for each sector, initial
+		// and final flavour, so that oscillated spectra are given by the
+		// probabilities at the centres of true bins, NCs are not oscillated
+		bool kResponse, kResponseChecked;
+		std::string _response_file;
+		std::vector<double> _response_energy, _response_cosz;
+		std::unique_ptr<Oscillogram> _response_ogram;
+		std::vector<Eigen::SparseMatrix<double> > _response;
+		Eigen::VectorXd _response_nc;
 
 		// binning information is stored as root histograms
 		std::unordered_map<std::string, TH2D*> _reco_hist, _true_hist;
 		//std::unordered_map<std::string, Eigen::MatrixXd> _bin_contents;
 		std::map<int, std::string> _type_names;	 // order important!
+		// offset and size of each type in one vector with all the spectra
+		// flattened as returned by BuildSamples, without under/overflow
+		std::map<std::string, std::pair<size_t, size_t> > _spectra;
+		size_t _nSpectra;
 
 		// For root stuff
 		std::unique_ptr<TChain> dm; //, nh, ih;
@@ -79,6 +163,4 @@ class AtmoSample : public Sample
 		double _weight, _reduce;
 };
 
-//void CreateTensor(CardDealer *cd);
-
 #endif
@@ -35,6 +35,8 @@ class BeamSample : public Sample
 
 		std::unordered_map<std::string, Eigen::VectorXd>
 			BuildSamples(std::shared_ptr<Oscillator> osc = nullptr) override;
+		std::unordered_map<std::string, Eigen::MatrixXd>
+			BuildJacobians(std::shared_ptr<Oscillator> osc) override;
 		virtual std::unordered_map<std::string, Eigen::VectorXd>
 			Unfold(const Eigen::VectorXd &En);
 
@@ -42,6 +44,11 @@ class BeamSample : public Sample
 
 	private:
 		std::unordered_map<std::string, Eigen::MatrixXd> _reco;
+
+		// bin centres of true energy, set as precomputed energies of the
+		// oscillator, and position of the bins of each type among them
+		std::vector<double> _energies;
+		std::unordered_map<std::string, std::vector<int> > _energy_index;
 		//std::unordered_map<std::string, Eigen::MatrixXd> _FD_reco;//fakedata
 		//std::map<std::string, std::vector<double> > _binX;
 		//std::map<std::string, std::vector<double> > _binY;
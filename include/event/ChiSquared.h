@@ -44,6 +44,9 @@ class ChiSquared
 			else _sample.push_back(std::shared_ptr<Sample>(new S(card, proc)));
 		}
 		void SetPoint(int p);
+		// true if any sample builds its spectra from dCP harmonics
+		bool UseHarmonics() const;
+		std::pair<size_t, size_t> HarmonicsUsage() const;
 
 		void Init(const CardDealer &cd);
 		bool Combine();
@@ -52,6 +55,7 @@ class ChiSquared
 		//void CombineSystematics();
 		std::unordered_map<std::string, Eigen::VectorXd> BuildSamples(std::shared_ptr<Oscillator> osc = nullptr);
 		Eigen::VectorXd ConstructSamples(std::shared_ptr<Oscillator> osc = nullptr);
+		Eigen::MatrixXd ConstructJacobian(std::shared_ptr<Oscillator> osc);
 
 		int NumSys();
 		int NumBin();
@@ -119,6 +123,7 @@ class ChiSquared
 		size_t maxIteration, maxTrials;
 		double fitErr;
 		bool zeroEpsilons;
+		int kHarmonics;		// -1 means use the sample option
 
 		double lm_0, lm_up, lm_down, lm_min;	//control fit parameters
 
@@ -11,6 +11,7 @@
 #include <unordered_map>
 #include <map>
 #include <vector>
+#include <list>
 #include <memory>
 #include <utility>
 
@@ -47,6 +48,10 @@ class Sample
 		virtual void LoadSystematics(const CardDealer &cd) = 0;
 		virtual std::unordered_map<std::string, Eigen::VectorXd>
 			BuildSamples(std::shared_ptr<Oscillator> osc = nullptr) = 0;
+		// derivatives of BuildSamples with respect to the oscillation
+		// parameters, as in Oscillator::ProbabilityGradient, one column each
+		virtual std::unordered_map<std::string, Eigen::MatrixXd>
+			BuildJacobians(std::shared_ptr<Oscillator> osc) = 0;
 
 		virtual int NumBin();
 		virtual int NumSys();
@@ -60,6 +65,17 @@ class Sample
 		// same for every one
 		// BuildSpectrum and then collates everything on a Eigen::Vector
 		virtual Eigen::VectorXd ConstructSamples(std::shared_ptr<Oscillator> osc = nullptr);
+		// BuildJacobians and collates them as above, one row per bin
+		virtual Eigen::MatrixXd ConstructJacobian(std::shared_ptr<Oscillator> osc);
+		// the spectra are trigonometric polynomials of degree 2 in dCP
+		// so they are exactly rebuilt from five evaluations at fixed dCP
+		virtual Eigen::MatrixXd Harmonics(std::shared_ptr<Oscillator> osc);
+		static Eigen::VectorXd HarmonicBasis(double cp);
+		void SetHarmonics(bool harm);
+		bool UseHarmonics() const { return kHarmonics; }
+		// calls of Harmonics and how many found the coefficients cached
+		std::pair<size_t, size_t> HarmonicsUsage() const {
+			return std::make_pair(_harm_calls, _harm_hits); }
 		// opposite function as above but must be defined in child class
 		virtual std::unordered_map<std::string, Eigen::VectorXd>
 			Unfold(const Eigen::VectorXd &En) = 0;
@@ -128,9 +144,21 @@ class Sample
 		virtual Eigen::SparseMatrix<double> ScaleMatrix(Xi xi, const Eigen::VectorXd &epsil);
 
 	protected:
+		Eigen::VectorXd CollateSamples(std::shared_ptr<Oscillator> osc);
+
 		int kVerbosity;
 		bool zeroEpsilons;
 
+		// harmonic coefficients of the spectra for each set of
+		// masses and mixing angles, least recently used are removed first
+		// with dCP as the fastest parameter, as in fitter and atmo_input,
+		// only the current set and the one of the true point are reused
+		bool kHarmonics;
+		size_t _harm_cache, _harm_calls, _harm_hits;
+		std::list<std::vector<double> > _harm_order;
+		std::map<std::vector<double>, std::pair<Eigen::MatrixXd,
+			 std::list<std::vector<double> >::iterator> > _harmonics;
+
 		// matter profile stored here
 		// remember to set it with
 		// 	osc->SetMatterProfile(_lens_dens)
@@ -14,7 +14,9 @@
 #include <random>
 
 #include <map>
+#include <set>
 #include <vector>
+#include <array>
 #include <tuple>
 
 #include <numeric>
@@ -22,6 +24,7 @@
 #include <memory>
 
 #include "tools/CardDealer.h"
+#include "tools/Philox.h"
 
 #include "physics/Const.h"
 #include "physics/Flavors.h"
@@ -30,33 +33,108 @@
 class Atmosphere
 {
 	public:
+		// matter profiles with the weight of each in an average
+		typedef std::vector<std::pair<double, Oscillator::Profile> > Profiles;
+
 		Atmosphere(const std::string &card);
 		Atmosphere(const CardDealer &cd);
 		Atmosphere(CardDealer *cd);
 
 		void LoadProductionHeights(const CardDealer &cd);
 		void LoadDensityProfile(const CardDealer &cd, std::string table_file = "");
+		// adjacent shells of the density profile are merged as long as
+		// the probabilities, for the parameters of osc, differ from the
+		// full profile at most by threshold, which is returned
+		// the first one uses an oscillator from the card, if requested
+		void MergeLayers(const CardDealer &cd);
+		double MergeLayers(std::shared_ptr<Oscillator> osc, double threshold);
+		// profiles on a grid in cosz and height, after the ones above
+		void CacheProfiles(const CardDealer &cd);
 
 		double RandomHeight(Nu::Flavor flv, double cosz, double energy);
 		Oscillator::Profile MatterProfile(Nu::Flavor flv, double cosz, double energy);
-		Oscillator::Profile MatterProfile(double cosz, double atm = -1);
+		Oscillator::Profile MatterProfile(double cosz, double atm = -1) const;
+
+		// same as above, with random numbers from a generator owned by
+		// the caller, for example one stream per event, so that the heights
+		// do not depend on threads or on the order of the events
+		double RandomHeight(Nu::Flavor flv, double cosz, double energy,
+				    Philox &rng) const;
+		Oscillator::Profile MatterProfile(Nu::Flavor flv, double cosz, double energy,
+						  Philox &rng) const;
+
+		// production height at cumulative probability prob
+		double Height(Nu::Flavor flv, double cosz, double energy, double prob) const;
+		// heights at many probabilities for the same flavour, cosz, and energy
+		void Heights(Nu::Flavor flv, double cosz, double energy,
+			     const std::vector<double> &probs, std::vector<double> &heights) const;
+
+		// profiles at the quantile heights of the quadrature, if set,
+		// otherwise one profile at a random height with weight one
+		int Quadrature() const;
+		Profiles MatterProfiles(Nu::Flavor flv, double cosz, double energy);
+		Profiles MatterProfiles(Nu::Flavor flv, double cosz, double energy,
+					Philox &rng) const;
+
+		// index of the cached profile nearest to cosz and height atm,
+		// or -1 if there is no cache, and the profile at that index
+		int ProfileIndex(double cosz, double atm = -1) const;
+		const Oscillator::Profile &CachedProfile(int index) const;
+		// same as MatterProfiles, but with indices of cached profiles
+		// filled in a vector owned by the caller, to avoid allocations
+		void ProfileIndices(Nu::Flavor flv, double cosz, double energy,
+				    std::vector<std::pair<double, int> > &indices);
+		void ProfileIndices(Nu::Flavor flv, double cosz, double energy,
+				    std::vector<std::pair<double, int> > &indices,
+				    Philox &rng) const;
+		// largest difference of the cached profiles from the exact ones
+		// within each cell of the grid, in length (km) and in electron
+		// column density (km g/cm3), which is returned
+		double CacheError(double &length) const;
 
 		//std::map<std::string, Eigen::VectorXd>
 		//	Oscillate(const std::vector<std::pair<double, double> > &bins, 
 		//	const std::map<std::string, std::pair<Nu::Flavor, Nu::Flavor> > &oscf, Oscillator *osc = 0);
 
 	private:
+		// offsets of the rows at the corners around a point in cosz and
+		// energy, from the first corner, and the distances from it
+		struct Cell
+		{
+			size_t row[4];
+			double ed, cd;
+		};
+
+		bool Locate(Nu::Flavor flv, double cosz, double energy, Cell &cell) const;
+		double Interpolate(const Cell &cell, double prob) const;
+
+		// largest difference in probabilities from the full profile
+		// for the paths that reach within radius of the centre
+		double MergeError(std::shared_ptr<Oscillator> osc,
+				  const std::vector<double> &coszs, const Eigen::ArrayXd &energies,
+				  const std::vector<Eigen::ArrayXXd> &full, double radius);
+
 		Oscillator::Profile _profile;
+		// shells with the same group are merged in one layer, if not empty
+		std::vector<int> _group;
 		int kVerbosity;
 		double _atm;
 
 		std::vector<double> _problibs, _energies, _zenithas;
-		std::mt19937 gen;
+		// Gauss-Legendre nodes in probability and their weights
+		std::vector<double> _quad_p, _quad_w;
+		Philox gen;
+
+		// cache of nz bins in cosz, with nodes at their centres,
+		// times nh nodes in height, from 0 in steps of dh
+		std::vector<Oscillator::Profile> _cache;
+		int _cache_nz, _cache_nh;
+		double _cache_dh, _cache_len_err, _cache_col_err;
 
-		std::map<int, std::vector<double> > nuE0_table;
-		std::map<int, std::vector<double> > nuM0_table;
-		std::map<int, std::vector<double> > nuEb_table;
-		std::map<int, std::vector<double> > nuMb_table;
+		// production heights in a single array, ordered by flavour
+		// (E, M, Eb, Mb), cosz, energy, cumulative probability
+		std::vector<double> _heights;
+		size_t _stride_f, _stride_c, _stride_e;
 
 };
 
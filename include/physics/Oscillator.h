@@ -10,6 +10,9 @@
 #include <vector>
 #include <array>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <functional>
 #include <cmath>
 #include <complex>
 #include <algorithm>
@@ -44,8 +47,39 @@ class Oscillator
 		using LDY = std::array<double, 3>;
 		using Profile = std::vector<LDY>;
 
+		// look up table of probability matrices, the entries are keyed by
+		// matter profile fingerprint, sector, and energy and they are kept
+		// in a list ordered by last use, so that least recent ones are removed
+		struct LUTKey
+		{
+			size_t profile;
+			int sector;	// 0 for neutrinos, 1 for antineutrinos
+			double energy;
+		};
+		struct LUTEntry
+		{
+			Eigen::MatrixXd prob;
+			std::list<LUTKey>::iterator use;
+		};
+		using LUT = std::map<double, LUTEntry>;
+
+		// scratch state owned by one thread for the const evaluation
+		// methods, the matter profile is kept here instead of in the
+		// oscillator, so that threads can share the same oscillator
+		struct Context
+		{
+			Profile profile;
+			size_t fingerprint = 0;
+
+			void SetMatterProfile(const Profile &ld) {
+				profile = ld;
+				fingerprint = Oscillator::Fingerprint(ld);
+			}
+		};
+
 		// anyone can access this without object
 		static Oscillator::Profile GetMatterProfile(const std::string &densityFile);
+		static size_t Fingerprint(const Oscillator::Profile &ld);
 
 		static double Length(const Oscillator::Profile &ld);	// return total baseline
 		static double Density(const Oscillator::Profile &ld);	// return average density
@@ -78,13 +112,50 @@ class Oscillator
 
 		double Probability(Nu::Flavor in, Nu::Flavor out,
 				double energy, bool force = false);
+		// batched version, for many energies and the same matter profile
+		Eigen::ArrayXd Probability(Nu::Flavor in, Nu::Flavor out,
+				const Eigen::ArrayXd &energies, bool force = false);
+		// all probabilities of the neutrino or antineutrino sector of nu
+		Eigen::MatrixXd ProbabilityMatrix(Nu::Flavor nu, double energy);
+		Eigen::ArrayXXd ProbabilityMatrix(Nu::Flavor nu,
+				const Eigen::ArrayXd &energies);
+		// const evaluation path, after Prepare is called the oscillator
+		// is not changed and can be used by many threads at once, each
+		// with its own context, until parameters are changed again
+		// the flat table is filled only if table is true
+		void Prepare(bool table = true);
+		double Probability(const Context &ctx, Nu::Flavor in, Nu::Flavor out,
+				double energy) const;
+		Eigen::MatrixXd ProbabilityMatrix(const Context &ctx, Nu::Flavor nu,
+				double energy) const;
+		Eigen::ArrayXXd ProbabilityMatrix(const Context &ctx, Nu::Flavor nu,
+				const Eigen::ArrayXd &energies) const;
+
+		// single precision batched kernel, if enabled, is checked once
+		// against the double precision one and disabled if not accurate
+		bool PrecisionCheck(const Eigen::ArrayXd &energies);
+		// as above, and fills grad with the derivatives of the
+		// probabilities with respect to M12, M23, S12, S13, S23, dCP
+		Eigen::MatrixXd ProbabilityGradient(Nu::Flavor nu, double energy,
+				std::vector<Eigen::MatrixXd> &grad);
 		//void Oscillate(Nu in, Nu out, TH1D* h);
 		Eigen::VectorXd Oscillate(Nu::Flavor in, Nu::Flavor out,
 				const std::vector<double> &bins);
 		void Reset();
-		std::map<double, Eigen::MatrixXd>::iterator FindEnergy(double energy);
+		LUT::iterator FindEnergy(double energy, int sector = 0);
+		// number of look ups in the LUT and how many found a matrix
+		std::pair<size_t, size_t> LUTUsage() const;
+
+		// precomputed energies, the probability matrices of all of them
+		// are computed together and stored contiguously in a flat table
+		// which is looked up by index, the map above is used otherwise
+		void SetEnergies(const std::vector<double> &energies);
+		int EnergyIndex(double energy) const;
+		Eigen::Map<const Eigen::MatrixXd> ProbabilityAt(Nu::Flavor nu, int index);
 
 		Eigen::MatrixXcd TransitionMatrix(double energy);
+		// amplitudes of the neutrino or antineutrino sector of nu only
+		Eigen::MatrixXcd TransitionMatrix(Nu::Flavor nu, double energy);
 		Eigen::MatrixXcd TransitionMatrix(double ff, double l2e);
 		void MatterMatrices(Eigen::MatrixXd &dmMatVac,
 				    Eigen::MatrixXd &dmMatMat,
@@ -139,19 +210,136 @@ class Oscillator
 		void SetPMNS_sin(double s12, double s13, double s23, double cp);
 		void SetPMNS_sin2(double s12, double s13, double s23, double cp);
 		void SetPMNS_angles(double t12, double t13, double t23, double cp);
+		// fourth neutrino, only if neutrinos is 4
+		void SetSterile(double dm41, double s14, double s24, double s34);
+
+		// only change the CP phase, keeping the mixing angles
+		void SetCP(double cp);
 
 		Eigen::MatrixXcd PMNS();
 		Eigen::VectorXd Masses();
+		Eigen::VectorXd Mixing();	// sines of the mixing angles
+		double CP();
 
 	private:
+		void CheckFlavors(Nu::Flavor in, Nu::Flavor out, bool force);
+		void SelectTable();
+		void Invariants();
+		void FillTable();
+		LUT::iterator LookUp(double energy, int sector);
+		Eigen::Map<const Eigen::MatrixXd> TableEntry(Nu::Flavor nu, int index) const;
+		// dispatch to the kernel with the right number of neutrinos
+		Eigen::MatrixXcd Amplitude(const Profile &lens_dens,
+				double energy, int sector) const;
+		template <typename T>
+		Eigen::ArrayXXd BatchProbability(const Profile &lens_dens,
+				const Eigen::ArrayXd &energies, int sector) const;
+		void CheckPrepared() const;
+
+		// fixed size types for the propagation kernel, which is
+		// specialised on the number N of neutrino flavours
+		// and propagates only one sector, neutrinos or antineutrinos
+		// the kernel is const and the profile is passed explicitly
+		template <int N>
+		using MassMatrix = Eigen::Matrix<double, 2*N, N>;
+		template <int N>
+		using StateVector = Eigen::Matrix<double, N, 1>;
+		template <int N>
+		using Sector = Eigen::Matrix<std::complex<double>, N, N>;
+
+		template <int N>
+		using Phases = Eigen::Matrix<std::complex<double>, 2*N, 1>;
+
+		template <int N>
+		Sector<N> Propagate(const Profile &lens_dens, double energy, int sector) const;
+		static int MirrorStart(const Profile &lens_dens);
+		template <int N>
+		bool MirrorPhases(Phases<N> &dd) const;
+		template <int N>
+		Sector<N> ConstantDensity(const LDY &ld, double energy, int sector) const;
+		template <int N>
+		Sector<N> Hamiltonian(double ff, int sector, double fn = 0) const;
+		template <int N>
+		Sector<N> PropagateGradient(const Profile &lens_dens, double energy,
+				int sector, std::array<Sector<N>, 6> &damp) const;
+		template <int N>
+		Sector<N> LayerMatrix(double ff, double l2e, int sector) const;
+		template <int N>
+		StateVector<N> SortedStates(double ff, int sector) const;
+		template <int N>
+		void MatterMatrices(MassMatrix<N> &dmMatVac,
+				    MassMatrix<N> &dmMatMat,
+				    double ff) const;
+		template <int N>
+		StateVector<N> MatterStates(double ff, int off = 0) const;
+
+		// batched kernel, the energies are stored along the rows and
+		// each column is one element (i + N j) of the N x N matrix
+		// of the chosen sector, so that operations on a matrix element
+		// are vectorised across energies
+		template <int N, typename T = double>
+		using BatchMatrix = Eigen::Array<std::complex<T>, Eigen::Dynamic, N*N>;
+
+		template <int N, typename T = double>
+		BatchMatrix<N, T> BatchPropagate(const Profile &lens_dens,
+				const Eigen::ArrayXd &energies, int sector) const;
+		template <int N>
+		BatchMatrix<N> BatchConstantDensity(const LDY &ld,
+				const Eigen::ArrayXd &energies, int sector) const;
+		template <int N>
+		Eigen::ArrayXXd BatchStates(const Eigen::ArrayXd &ff, int off = 0) const;
+		template <int N, typename T>
+		static void BatchProduct(const BatchMatrix<N, T> &A,
+					 const BatchMatrix<N, T> &B,
+					 BatchMatrix<N, T> &C);
+
 		Eigen::MatrixXcd _pmns; //, _pmnsM, pmnsM, trans;
 		Eigen::VectorXd dms;
+		Eigen::VectorXd _sins;	// sines of the mixing angles
+		// mass splitting and sines of mixing angles of sterile neutrino
+		std::array<double, 4> _sterile = {{0, 0, 0, 0}};
+		double _cp;
 		Profile _lens_dens;
 
+		// derivatives of masses and of the neutrino pmns matrix
+		// with respect to the oscillation parameters
+		Eigen::MatrixXd _ddms;
+		std::vector<Eigen::MatrixXcd> _dpmns;
+
 		int _dim;	//number of neutrinos
 		double _thr;
 		bool kLUT;
-		std::map<double, Eigen::MatrixXd > mLUT;
+
+		// one table for each matter profile, with a copy of the profile
+		// to guard against fingerprint collisions
+		struct Table
+		{
+			Profile profile;
+			std::array<LUT, 2> lut;	// one per sector
+		};
+		std::unordered_map<size_t, Table> mLUT;
+		std::list<LUTKey> _lru;		// most recent first
+		size_t _profile;		// fingerprint of current profile
+		size_t _lut_size;		// max number of entries
+		size_t _lut_calls = 0, _lut_hits = 0;
+
+		// batched kernel in single precision
+		bool kFloat;
+		bool kChecked;		// compared with double precision
+		double _float_tol;	// max difference of probabilities
+
+		// flat table, for each energy the N x N matrices
+		// of neutrinos and then of antineutrinos
+		std::vector<double> _tab_energies, _table;
+		size_t _tab_profile;	// fingerprint of profile of table
+		bool kTable;		// table is up to date
+
+		// parameter only quantities, see Invariants
+		bool kInvariants;
+		Eigen::MatrixXd _ues;	// |Ue_i|², one row per sector
+		Eigen::MatrixXcd _ue2;	// matter term per unit density factor
+		Eigen::MatrixXcd _ham;	// vacuum hamiltonian in flavour basis
+		std::vector<int> _order; // permutation sorting matter solutions
 
 		//Fermi constant in SI units times Avogadro's constant (eV² cm³)/(mol GeV)
 		//double fG = 1.52588e-4 / sqrt(8);
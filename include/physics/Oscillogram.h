@@ -0,0 +1,65 @@
+/*
+ * This class tabulates the oscillation probabilities of atmospheric
+ * neutrinos on a grid in log10 of energy and cosine of zenith angle
+ * The grid is filled with the batched oscillator, one matter profile
+ * per zenith node, and probabilities at any point are then given
+ * by bicubic interpolation of the nodes
+ */
+
+#ifndef OSCILLOGRAM_H
+#define OSCILLOGRAM_H
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+
+#include "physics/Flavors.h"
+#include "physics/Oscillator.h"
+#include "physics/Atmosphere.h"
+
+#include "Eigen/Dense"
+
+class Oscillogram
+{
+	public:
+		// number of nodes ne and nz, including the end points
+		Oscillogram(double lemin, double lemax, int ne,
+			    double czmin, double czmax, int nz);
+
+		// fill the table for the current parameters of osc
+		// with the matter profiles from atm, at fixed production height
+		void Build(std::shared_ptr<Oscillator> osc, Atmosphere &atm);
+
+		// interpolated probabilities of the sector of nu, element (out, in)
+		// is from in to out as in Oscillator::ProbabilityMatrix
+		Eigen::MatrixXd ProbabilityMatrix(Nu::Flavor nu, double energy, double cosz) const;
+		double Probability(Nu::Flavor in, Nu::Flavor out,
+				   double energy, double cosz) const;
+
+		// probabilities from in to out at all the nodes, without
+		// interpolation, ordered by zenith then energy as in the table
+		Eigen::VectorXd Nodes(Nu::Flavor in, Nu::Flavor out) const;
+
+		// largest difference with exact propagation at the centres of the
+		// cells, where the interpolation error is largest, rms is also given
+		double ErrorBound(std::shared_ptr<Oscillator> osc, Atmosphere &atm,
+				  double &rms);
+
+	private:
+		// position of x in the grid, the stencil starts from the node
+		// before i and t is the fractional distance from node i
+		void Weights(double x, double x0, double dx, int n,
+			     std::array<int, 4> &idx, std::array<double, 4> &ww) const;
+
+		double _lemin, _dle, _czmin, _dcz;
+		int _ne, _nz, _dim;
+
+		// for each sector, nodes ordered by zenith then energy,
+		// with the N x N matrix of each node stored contiguously
+		std::array<std::vector<double>, 2> _prob;
+};
+
+#endif
@@ -35,6 +35,8 @@ class ParameterSpace
 		void GetEntry(int n, double &M12, double &M23,
 			      double &S12, double &S13, double &S23, double &dCP);
 		std::map<std::string, double> GetEntry(int n);
+		// entry of the n-th point when fastest is varied first
+		int GetOrderedEntry(int n, const std::string &fastest);
 
 		void GetNominal(double &M12, double &M23,
 			      double &S12, double &S13, double &S23, double &dCP);
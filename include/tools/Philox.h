@@ -0,0 +1,67 @@
+/* Philox
+ * counter based random numbers, Philox4x32-10 from
+ * Salmon et al., "Parallel random numbers: as easy as 1, 2, 3" (2011)
+ * each block of four numbers is a function of the key and the counter only,
+ * so a stream given by seed, index, and stream number gives the same numbers
+ * regardless of which other streams are drawn, in which order, or by which thread
+ * it can be used with the distributions of <random>
+ */
+
+#ifndef Philox_H
+#define Philox_H
+
+#include <array>
+#include <cstdint>
+
+class Philox
+{
+	public:
+		typedef uint32_t result_type;
+
+		// seed is the key, index and stream the fixed part of the counter
+		Philox(uint64_t seed = 0, uint64_t index = 0, uint32_t stream = 0) :
+			_key{{uint32_t(seed), uint32_t(seed >> 32)}},
+			_ctr{{uint32_t(index), uint32_t(index >> 32), stream, 0}},
+			_used(4)
+		{
+		}
+
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return 0xffffffff; }
+
+		// next number, a new block is computed every four of them
+		result_type operator()()
+		{
+			if (_used == 4) {
+				_out = Block(_ctr, _key);
+				++_ctr[3];
+				_used = 0;
+			}
+			return _out[_used++];
+		}
+
+		// ten rounds of multiplications and bumps of the key
+		static std::array<uint32_t, 4> Block(std::array<uint32_t, 4> ctr,
+						     std::array<uint32_t, 2> key)
+		{
+			for (int r = 0; r < 10; ++r) {
+				if (r) {
+					key[0] += 0x9E3779B9;
+					key[1] += 0xBB67AE85;
+				}
+
+				uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+				uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+				ctr = {{uint32_t(p1 >> 32) ^ ctr[1] ^ key[0], uint32_t(p1),
+					uint32_t(p0 >> 32) ^ ctr[3] ^ key[1], uint32_t(p0)}};
+			}
+			return ctr;
+		}
+
+	private:
+		std::array<uint32_t, 2> _key;
+		std::array<uint32_t, 4> _ctr, _out;
+		int _used;
+};
+
+#endif
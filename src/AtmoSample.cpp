@@ -71,6 +71,67 @@ void AtmoSample::Init(const CardDealer &cd, std::string process)
 	if (!cd.Get("reduce", _reduce))	// FV reduction
 		_reduce = 0.5;
 
+	// probabilities interpolated from a table in log10 E and cosz
+	// each grid is given as minimum, maximum, and number of nodes
+	int ogram;
+	if (!cd.Get("oscillogram", ogram))
+		ogram = 0;
+	if (ogram) {
+		std::vector<double> ge, gz;
+		if (!cd.Get("oscillogram_energy", ge))
+			ge = {-1., 2., 400};
+		if (!cd.Get("oscillogram_cosz", gz))
+			gz = {-1., 1., 200};
+		if (ge.size() != 3 || gz.size() != 3)
+			throw std::invalid_argument("AtmoSample: oscillogram grids "
+					"need minimum, maximum, and number of nodes");
+
+		_oscillogram.reset(new Oscillogram(ge[0], ge[1], ge[2],
+						   gz[0], gz[1], gz[2]));
+	}
+	kOscillogramChecked = false;
+
+	// events are oscillated in parallel, if more than one
+	if (!cd.Get("threads", _threads))
+		_threads = 1;
+
+	// each event has its own stream of random numbers, from this seed
+	// and its entry in the simulation files
+	if (!cd.Get("seed", _seed))
+		_seed = 0;
+
+	// number of buckets in cosz, if events are sorted
+	if (!cd.Get("sort_events", _buckets))
+		_buckets = 0;
+
+	// oscillated spectra from the response of the true bins
+	// instead of the event loop, grids are minimum, maximum, and bins
+	int response;
+	if (!cd.Get("response_tensor", response))
+		response = 0;
+	kResponse = response;
+	if (kResponse) {
+		if (!cd.Get("response_energy", _response_energy))
+			_response_energy = {-1., 4., 250};
+		if (!cd.Get("response_cosz", _response_cosz))
+			_response_cosz = {-1., 1., 100};
+		if (_response_energy.size() != 3 || _response_cosz.size() != 3)
+			throw std::invalid_argument("AtmoSample: response grids "
+					"need minimum, maximum, and number of bins");
+		if (!cd.Get("response_file", _response_file))
+			_response_file.clear();	// not cached
+
+		// nodes at the centres of the bins
+		double de = (_response_energy[1] - _response_energy[0]) / _response_energy[2];
+		double dz = (_response_cosz[1] - _response_cosz[0]) / _response_cosz[2];
+		_response_ogram.reset(new Oscillogram(
+				_response_energy[0] + de / 2., _response_energy[1] - de / 2.,
+				_response_energy[2],
+				_response_cosz[0] + dz / 2., _response_cosz[1] - dz / 2.,
+				_response_cosz[2]));
+	}
+	kResponseChecked = false;
+
 
 
 	if (kVerbosity) {
@@ -79,6 +140,8 @@ void AtmoSample::Init(const CardDealer &cd, std::string process)
 			std::cout << "\t" << it;
 		std::cout << std::endl;
 		std::cout << "AtmoSample: number of scale systematics " << _nScale << std::endl;
+		if (_threads > 1)
+			std::cout << "AtmoSample: using " << _threads << " threads" << std::endl;
 		for (const auto &it : _scale)
 			std::cout << "\t" << it.first << " -> " << it.second.first << std::endl;
 	}
@@ -246,6 +309,15 @@ void AtmoSample::LoadReconstruction(const CardDealer &cd) {
 		_type_names[ih.second] = ih.first;
 	}
 
+	_spectra.clear();
+	_nSpectra = 0;
+	for (const auto &it : _type_names) {
+		size_t size = _reco_hist[it.second]->GetNbinsX()
+			    * _reco_hist[it.second]->GetNbinsY();
+		_spectra[it.second] = std::make_pair(_nSpectra, size);
+		_nSpectra += size;
+	}
+
 	std::string chain;
 	if (!cd.Get("MC_input", chain))
 		throw std::invalid_argument("AtmoSample: no reconstruction files in card,"
@@ -311,6 +383,60 @@ void AtmoSample::LoadReconstruction(const CardDealer &cd) {
 
 	// ready to fill histograms
 	// create matrices for bin contents
+
+	LoadSimulation();
+}
+
+// events are read from the files only once, and the selection and
+// scaling of LoadEvent are applied here, so that the samples are
+// then built from memory for every oscillation point
+void AtmoSample::LoadSimulation()
+{
+	// only branches which are used
+	dm->SetBranchStatus("*", 0);
+	for (const char *br : {"ipnu", "mode", "itype", "dirnu", "pnu",
+			       "dir", "amom", "flxho", "weightx"})
+		dm->SetBranchStatus(br, 1);
+
+	_events = Events();
+	for (int i = 0; i < _nentries; ++i) {
+		std::string type;
+		int bin;
+		if (!LoadEvent(i, type, bin))
+			continue;
+
+		double factor_E, factor_M;
+		FluxFactors(factor_E, factor_M);
+
+		_events.pnu.push_back(pnu);
+		_events.cosz.push_back(-dirnu[2]);
+		_events.weight.push_back(weightx);
+		_events.factor_E.push_back(factor_E);
+		_events.factor_M.push_back(factor_M);
+		_events.bin.push_back(bin);
+		_events.flavor.push_back(Nu::fromPDG(ipnu));
+		_events.nc.push_back(std::abs(mode) >= 30);	// NCs have mode >= 30
+		_events.entry.push_back(i);
+	}
+
+	if (kVerbosity) {
+		size_t bytes = _events.size() * (5 * sizeof(float)
+					       + 3 * sizeof(int) + 2 * sizeof(char));
+		std::cout << "AtmoSample: " << _events.size() << " events out of "
+			  << _nentries << " stored in memory ("
+			  << bytes / (1024. * 1024.) << " MB)" << std::endl;
+	}
+
+	// files are not needed anymore
+	dm.reset();
+
+	if (_buckets)
+		SortEvents();
+
+	if (kResponse && !ReadResponse()) {
+		BuildResponse();
+		WriteResponse();
+	}
 }
 
 
@@ -346,13 +472,38 @@ std::unordered_map<std::string, Eigen::VectorXd> AtmoSample::BuildSamples(std::s
 {
 	std::unordered_map<std::string, Eigen::VectorXd> samples;
 
-	for (const auto &ih : _reco_hist)
-		ih.second->Reset("ICES");
+	// all types are filled together, positions are found at load time
+	Eigen::VectorXd spectra;
+	if (osc && kResponse) {
+		spectra = ResponseSpectra(osc);
+
+		// compared with the event loop the first time, as statistical
+		// significance of the largest difference and difference of totals
+		if (!kResponseChecked || kVerbosity > 1) {
+			Eigen::ArrayXd exact = FillEvents(osc).array();
+			Eigen::ArrayXd sigma = (spectra.array() - exact).abs()
+				* (_stats / exact.max(1e-9)).sqrt();
+			std::cout << "AtmoSample: response tensor differs from event loop by "
+				  << sigma.maxCoeff() << " sigma at most, total events by "
+				  << spectra.sum() / exact.sum() - 1 << std::endl;
+			kResponseChecked = true;
+		}
+	}
+	else
+		spectra = FillEvents(osc);
 
-	dm->SetBranchStatus("*", 1);
-	int first_event_type = _type_names.begin()->first;
-	int last_event_type = _type_names.rbegin()->first;
-	// loop through all events and fill histograms
+	for (const auto &is : _spectra)
+		samples[is.first] = spectra.segment(is.second.first, is.second.second);
+
+	return samples;
+}
+
+// oscillated spectra built event by event, flattened
+Eigen::VectorXd AtmoSample::FillEvents(std::shared_ptr<Oscillator> osc)
+{
+	Eigen::VectorXd spectra = Eigen::VectorXd::Zero(_nSpectra);
+
+	// loop through all events and fill spectra
 
 	//std::ostringstream address;
 	//address << "osccalc_" << (void const *)osc << ".root";
@@ -369,122 +520,598 @@ std::unordered_map<std::string, Eigen::VectorXd> AtmoSample::BuildSamples(std::s
 	//tt->Branch("fM",   &fM, "fM/D");
 	//tt->Branch("pE",   &pE, "pE/D");
 	//tt->Branch("pM",   &pM, "pM/D");
-	
-	if (_nentries != dm->GetEntries())
-		throw std::logic_error("AtmoSample: number off entires changed, file system error");
-	// keep updating _nentries to check status of file system
-	_nentries = dm->GetEntries();
 
 	if (kVerbosity)
-		std::cout << "AtmoSample: reading " << _nentries << " entries" << std::endl;
+		std::cout << "AtmoSample: reading " << _events.size() << " events" << std::endl;
 	
+	if (osc && _oscillogram) {
+		_oscillogram->Build(osc, *_atm_path);
+
+		// error is checked the first time, as it costs as much as the table
+		if (!kOscillogramChecked || kVerbosity > 1) {
+			double rms, err = _oscillogram->ErrorBound(osc, *_atm_path, rms);
+			std::cout << "AtmoSample: oscillogram error against exact "
+				  << "propagation is " << err << " at most, "
+				  << rms << " rms" << std::endl;
+			kOscillogramChecked = true;
+		}
+	}
 
-	for (int i = 0; i < _nentries; ++i) {
-	//for (int i = 0; i < 1000; ++i) {
-		//std::cout << "entry " << i << std::endl;
-		dm->GetEntry(i);	// all branches
-		itype -= 1;
+	// profiles set and look ups in the LUT, to measure reuse
+	size_t changes = 0;
+	std::pair<size_t, size_t> lut = osc ? osc->LUTUsage() : std::make_pair(size_t(0), size_t(0));
 
-		// uknown event types
-		if (itype < first_event_type || itype > last_event_type)
-			continue;
+	// indices of cached profiles of each event, if any
+	std::vector<std::pair<double, int> > cells;
+	int cell = -1;
+	Atmosphere::Profiles profiles;
 
-		// no NC tau's allowed, so skip
-		if (std::abs(mode) >= 30 && std::abs(ipnu) == 16)
-			continue;
+	if (_threads > 1)
+		changes = FillParallel(osc, spectra);
+	else for (size_t i = 0, current = -1; i < _events.size(); ++i) {
+		double weight = _events.weight[i];
+		double pnu = _events.pnu[i], cosz = _events.cosz[i];
 
-		// this is real data, which we do not want
-		if (pnu < 1.0e-7 && ipnu == 0 && mode == 0)
-			continue;
+		Nu::Flavor nu_out = Nu::Flavor(_events.flavor[i]);
+		if (osc && !_events.nc[i]) {
+			// this automatically get production height
+			// if honda flux is defined in card then height is generted
+			// from the random stream of the event
+			// otherwise is fixed to value defiend in card
+			// both initial flavours come from one propagation
+			// in the sector (neutrino or antineutrino) of nu_out
+			// or from the interpolation of the oscillogram
+			// sorted events share the profile of their bucket
+			Eigen::MatrixXd pm;
+			if (_oscillogram)
+				pm = _oscillogram->ProbabilityMatrix(nu_out, pnu, cosz);
+			else {
+				if (!_buckets && _atm_path->ProfileIndex(cosz) >= 0) {
+					Philox rng(_seed, _events.entry[i]);
+					_atm_path->ProfileIndices(nu_out, cosz, pnu, cells, rng);
+					pm = Averaged(*osc, nu_out, pnu, changes, cells, cell);
+				}
+				else {
+					bool same = _buckets && size_t(_events.profile[i]) == current;
+					current = _buckets ? _events.profile[i] : -1;
+					pm = Averaged(*osc, nu_out, pnu, changes,
+						EventProfiles(i, profiles), same);
+				}
+			}
+			weight = Oscillated(i, pm);
+		}
 
-		std::string type = _type_names[itype];
+		spectra(_events.bin[i]) += weight;
+	}
 
-		// bin is not in range, just skip it
-		int bin = _reco_hist[type]->FindBin(std::log10(amom), -dir[2]);
-		if ( _reco_hist[type]->IsBinOverflow(bin)
-		  || _reco_hist[type]->IsBinUnderflow(bin))
-			continue;
+	if (kVerbosity > 1 && osc && !_oscillogram) {
+		std::cout << "AtmoSample: " << changes << " matter profiles set for "
+			  << _events.size() << " events";
+		if (osc->LUTUsage().first > lut.first)
+			std::cout << ", LUT hit rate " << double(osc->LUTUsage().second - lut.second)
+				/ (osc->LUTUsage().first - lut.first);
+		std::cout << std::endl;
+	}
+
+	//tt->Write();
+	//oscout.Close();
 
+	return spectra;
+}
 
-		weightx *= _weight;
-		if (itype > 70)
-			weightx *= _reduce;
-		//W = weightx;
+// the events are split in contiguous blocks, one per thread, and each
+// thread fills its own spectra with the const path of the oscillator
+// heights come from the stream of each event, so the result is the same
+// as the single thread loop, up to the order of the sums
+size_t AtmoSample::FillParallel(std::shared_ptr<Oscillator> osc, Eigen::VectorXd &spectra)
+{
+	// only the invariants, the flat table of precomputed energies
+	// is for the beam profile and is not used here
+	if (osc && !_oscillogram)
+		osc->Prepare(false);
+
+	std::vector<Eigen::VectorXd> partial(_threads);
+	std::vector<size_t> changes(_threads, 0);
+	std::vector<std::exception_ptr> errors(_threads);
+	std::vector<std::thread> workers;
+
+	size_t block = (_events.size() + _threads - 1) / _threads;
+	for (int t = 0; t < _threads; ++t) {
+		size_t begin = std::min(_events.size(), t * block);
+		size_t end = std::min(_events.size(), begin + block);
+		workers.emplace_back([&, t, begin, end]() {
+			try {
+				FillSpectra(osc.get(), begin, end, partial[t], changes[t]);
+			}
+			catch (...) {
+				errors[t] = std::current_exception();
+			}
+		});
+	}
 
-		double factor_E = 1, factor_M = 1;
-		if (std::abs(ipnu) == 12)	// it is e type
-      			factor_M = flxho[1] / flxho[0];
-		else				// it is mu or tau type
-      			factor_E = flxho[0] / flxho[1];
-		//fE = factor_E;
-		//fM = factor_M;
+	for (auto &w : workers)
+		w.join();
 
+	// summed in order of thread, not of completion
+	for (int t = 0; t < _threads; ++t) {
+		if (errors[t])
+			std::rethrow_exception(errors[t]);
+		spectra += partial[t];
+	}
 
-		Nu::Flavor nu_out = Nu::fromPDG(ipnu);
-		//Nu::Flavor nue, num;
-		if (osc && std::abs(mode) < 30) {	// NCs have mode >= 30
-			// LUT is cleared in this step
-			// -1 dirnu[2] ?? ???? ?? ? ? ? ? ? ?
-			//double hgt = atm_path->GenerateRandomHeight(nu_out, -dirnu[2], pnu);
-			//std::cout << "production height " << hgt << std::endl;
-			//Oscillator::Profile ld = atm_path->MatterProfile(-dirnu[2], 15);
-			//osc->SetMatterProfile(ld);
+	return std::accumulate(changes.begin(), changes.end(), size_t(0));
+}
 
-			// this automatically get production height
-			// if honda flux is defined in card then height is generted
-			// otherwise is fixed to value defiend in card
-			osc->SetMatterProfile(_atm_path->MatterProfile(nu_out, -dirnu[2], pnu));
+// fill spectra with events from begin to end, changes counts the profiles set
+void AtmoSample::FillSpectra(const Oscillator *osc, size_t begin, size_t end,
+			     Eigen::VectorXd &spectra, size_t &changes) const
+{
+	spectra = Eigen::VectorXd::Zero(_nSpectra);
 
-			// but thanks to LUT, probability is computed only once
-			if (ipnu > 0)	// neutrino
-			{
-				//pE = osc->Probability(Nu::E_, nu_out, pnu);
-				//pM = osc->Probability(Nu::M_, nu_out, pnu);
+	Oscillator::Context ctx;
 
-				weightx *= factor_E * osc->Probability(Nu::E_, nu_out, pnu)
-					+  factor_M * osc->Probability(Nu::M_, nu_out, pnu);
-				//nue = Nu::E_; num = Nu::M_;
-			}
-			else {		//antineutrino
-				//pE = osc->Probability(Nu::Eb, nu_out, pnu);
-				//pM = osc->Probability(Nu::Mb, nu_out, pnu);
+	// indices of cached profiles of each event, if any
+	std::vector<std::pair<double, int> > cells;
+	int cell = -1;
+	Atmosphere::Profiles profiles;
+
+	for (size_t i = begin, current = -1; i < end; ++i) {
+		double weight = _events.weight[i];
+		double pnu = _events.pnu[i], cosz = _events.cosz[i];
 
-				weightx *= factor_E * osc->Probability(Nu::Eb, nu_out, pnu)
-					+  factor_M * osc->Probability(Nu::Mb, nu_out, pnu);
-				//nue = Nu::Eb; num = Nu::Mb;
+		Nu::Flavor nu_out = Nu::Flavor(_events.flavor[i]);
+		if (osc && !_events.nc[i]) {
+			Eigen::MatrixXd pm;
+			if (_oscillogram)
+				pm = _oscillogram->ProbabilityMatrix(nu_out, pnu, cosz);
+			else {
+				if (!_buckets && _atm_path->ProfileIndex(cosz) >= 0) {
+					Philox rng(_seed, _events.entry[i]);
+					_atm_path->ProfileIndices(nu_out, cosz, pnu, cells, rng);
+					pm = Averaged(*osc, ctx, nu_out, pnu, changes, cells, cell);
+				}
+				else {
+					bool same = _buckets && size_t(_events.profile[i]) == current;
+					current = _buckets ? _events.profile[i] : -1;
+					pm = Averaged(*osc, ctx, nu_out, pnu, changes,
+						EventProfiles(i, profiles), same);
+				}
 			}
-			//std::cout << "layers at " << -dirnu[2] << " is "
-			//	  << ld.size() << ": " << osc->Length() << "\n";
-			//for (const auto &l : ld)
-			//	std::cout << "\t" << std::get<0>(l) << std::endl;
-			//if (itype == 72)
-				//std::cout << i << " " << itype << " -> " << factor_E << "\t" << factor_M
-				  	//<< "\t" << weightx << std::endl; 
+			weight = Oscillated(i, pm);
 		}
 
-		_reco_hist[type]->Fill(std::log10(amom), -dir[2], weightx);
+		spectra(_events.bin[i]) += weight;
 	}
+}
 
-	//tt->Write();
-	//oscout.Close();
+// weight of event i after oscillation, given the probabilities
+// of its sector, as in Oscillator::ProbabilityMatrix
+double AtmoSample::Oscillated(size_t i, const Eigen::MatrixXd &pm) const
+{
+	Nu::Flavor nu_out = Nu::Flavor(_events.flavor[i]);
 
-	for (const auto &ir : _reco_hist) {
-		int xs = ir.second->GetNbinsX();	// energy
-		int ys = ir.second->GetNbinsY();	// cosz
-		Eigen::MatrixXd rm = Eigen::Map<Eigen::MatrixXd>
-			(ir.second->GetArray() + xs + 2, xs + 2, ys);
+	// weights were single precision
+	return float(_events.weight[i] * (_events.factor_E[i] * pm(nu_out % 3, Nu::E_)
+					+ _events.factor_M[i] * pm(nu_out % 3, Nu::M_)));
+}
 
-		// remove first and last columns
-		rm.transposeInPlace();
-		rm.leftCols(xs) = rm.middleCols(1, xs);
-		rm.conservativeResize(ys, xs);
+// matter profiles of event i, the shared ones of its bucket if sorted,
+// or else its own from its random stream, which are stored in own
+const Atmosphere::Profiles &AtmoSample::EventProfiles(size_t i,
+						      Atmosphere::Profiles &own) const
+{
+	if (_buckets)
+		return _profiles[_events.profile[i]];
 
-		//std::cout << ir.first << "\n" << rm.rowwise().sum() << "\n" << std::endl;
-		samples[ir.first] = Eigen::Map<Eigen::VectorXd>(rm.data(), rm.cols() * rm.rows());
+	Philox rng(_seed, _events.entry[i]);
+	own = _atm_path->MatterProfiles(Nu::Flavor(_events.flavor[i]),
+					_events.cosz[i], _events.pnu[i], rng);
+	return own;
+}
 
+// probabilities averaged over the weighted profiles, a single profile
+// is not set again if same, as for consecutive events of one bucket
+Eigen::MatrixXd AtmoSample::Averaged(Oscillator &osc, Nu::Flavor nu, double energy,
+				     size_t &changes, const Atmosphere::Profiles &profiles,
+				     bool same) const
+{
+	if (profiles.size() == 1) {
+		if (!same) {
+			osc.SetMatterProfile(profiles.front().second);
+			++changes;
+		}
+		return osc.ProbabilityMatrix(nu, energy);
 	}
 
-	return samples;
+	Eigen::MatrixXd pm;
+	for (const auto &ip : profiles) {
+		osc.SetMatterProfile(ip.second);
+		++changes;
+		if (pm.size())
+			pm += ip.first * osc.ProbabilityMatrix(nu, energy);
+		else
+			pm = ip.first * osc.ProbabilityMatrix(nu, energy);
+	}
+	return pm;
+}
+
+// same as above, with the const path of the oscillator
+Eigen::MatrixXd AtmoSample::Averaged(const Oscillator &osc, Oscillator::Context &ctx,
+				     Nu::Flavor nu, double energy, size_t &changes,
+				     const Atmosphere::Profiles &profiles, bool same) const
+{
+	if (profiles.size() == 1) {
+		if (!same) {
+			ctx.SetMatterProfile(profiles.front().second);
+			++changes;
+		}
+		return osc.ProbabilityMatrix(ctx, nu, energy);
+	}
+
+	Eigen::MatrixXd pm;
+	for (const auto &ip : profiles) {
+		ctx.SetMatterProfile(ip.second);
+		++changes;
+		if (pm.size())
+			pm += ip.first * osc.ProbabilityMatrix(ctx, nu, energy);
+		else
+			pm = ip.first * osc.ProbabilityMatrix(ctx, nu, energy);
+	}
+	return pm;
+}
+
+// as above, with profiles cached by the atmosphere, and the index of the
+// current one, which is not set again
+Eigen::MatrixXd AtmoSample::Averaged(Oscillator &osc, Nu::Flavor nu, double energy,
+				     size_t &changes, const std::vector<std::pair<double, int> > &cells,
+				     int &current) const
+{
+	Eigen::MatrixXd pm;
+	for (const auto &ic : cells) {
+		if (ic.second != current) {
+			current = ic.second;
+			osc.SetMatterProfile(_atm_path->CachedProfile(current));
+			++changes;
+		}
+		if (pm.size())
+			pm += ic.first * osc.ProbabilityMatrix(nu, energy);
+		else
+			pm = ic.first * osc.ProbabilityMatrix(nu, energy);
+	}
+	return pm;
+}
+
+Eigen::MatrixXd AtmoSample::Averaged(const Oscillator &osc, Oscillator::Context &ctx,
+				     Nu::Flavor nu, double energy, size_t &changes,
+				     const std::vector<std::pair<double, int> > &cells,
+				     int &current) const
+{
+	Eigen::MatrixXd pm;
+	for (const auto &ic : cells) {
+		if (ic.second != current) {
+			current = ic.second;
+			ctx.SetMatterProfile(_atm_path->CachedProfile(current));
+			++changes;
+		}
+		if (pm.size())
+			pm += ic.first * osc.ProbabilityMatrix(ctx, nu, energy);
+		else
+			pm = ic.first * osc.ProbabilityMatrix(ctx, nu, energy);
+	}
+	return pm;
+}
+
+template <typename T>
+static void Permute(std::vector<T> &v, const std::vector<size_t> &order)
+{
+	std::vector<T> sorted;
+	sorted.reserve(order.size());
+	for (size_t i : order)
+		sorted.push_back(v[i]);
+	v.swap(sorted);
+}
+
+// events with the same flavour and in the same bucket of cosz share
+// the matter profiles at the centre of the bucket, for the median energy
+// of the bucket, either at the heights of the quadrature or at one height
+// drawn from a random stream keyed on flavour and bucket, so it does not
+// depend on the event order
+// within a bucket events are sorted by energy, for the LUT of the oscillator
+void AtmoSample::SortEvents()
+{
+	std::vector<int> bucket(_events.size());
+	for (size_t i = 0; i < _events.size(); ++i)
+		bucket[i] = std::max(0, std::min(_buckets - 1,
+				int((_events.cosz[i] + 1.) / 2. * _buckets)));
+
+	std::vector<size_t> order(_events.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return std::make_tuple(_events.flavor[a], bucket[a], _events.pnu[a])
+			     < std::make_tuple(_events.flavor[b], bucket[b], _events.pnu[b]); });
+
+	Permute(_events.pnu, order);
+	Permute(_events.cosz, order);
+	Permute(_events.weight, order);
+	Permute(_events.factor_E, order);
+	Permute(_events.factor_M, order);
+	Permute(_events.bin, order);
+	Permute(_events.flavor, order);
+	Permute(_events.nc, order);
+	Permute(_events.entry, order);
+	Permute(bucket, order);
+
+	_profiles.clear();
+	_events.profile.assign(_events.size(), -1);
+	for (size_t i = 0, j = 0; i < _events.size(); i = j) {
+		while (j < _events.size() && _events.flavor[j] == _events.flavor[i]
+					  && bucket[j] == bucket[i])
+			++j;
+
+		Nu::Flavor nu = Nu::Flavor(_events.flavor[i]);
+		double cosz = (bucket[i] + 0.5) * 2. / _buckets - 1.;
+		// streams of buckets are apart from the ones of events
+		Philox rng(_seed, nu * _buckets + bucket[i], 1);
+		std::fill(_events.profile.begin() + i, _events.profile.begin() + j,
+			  _profiles.size());
+		_profiles.push_back(_atm_path->MatterProfiles(nu, cosz,
+					_events.pnu[(i + j) / 2], rng));
+	}
+
+	if (kVerbosity)
+		std::cout << "AtmoSample: events sorted in " << _profiles.size()
+			  << " groups of flavour and " << _buckets
+			  << " buckets of cosz" << std::endl;
+}
+
+// matrices are ordered by sector, initial flavour (E or M), final flavour
+int AtmoSample::ResponseChannel(Nu::Flavor in, Nu::Flavor out) const
+{
+	return (in / 3 * 2 + in % 3) * 3 + out % 3;
+}
+
+// each CC event contributes to the two channels from the initial flavours
+// with the flux ratios, in the true bin of its energy and zenith angle
+// events outside the true grid are moved to the closest bin
+void AtmoSample::BuildResponse()
+{
+	const double emin = _response_energy[0], zmin = _response_cosz[0];
+	const int ne = _response_energy[2], nz = _response_cosz[2];
+	const double de = (_response_energy[1] - emin) / ne;
+	const double dz = (_response_cosz[1] - zmin) / nz;
+
+	std::vector<std::vector<Eigen::Triplet<double> > > triplets(12);
+	_response_nc = Eigen::VectorXd::Zero(_nSpectra);
+	for (size_t i = 0; i < _events.size(); ++i) {
+		if (_events.nc[i]) {
+			_response_nc(_events.bin[i]) += _events.weight[i];
+			continue;
+		}
+
+		int e = std::floor((std::log10(_events.pnu[i]) - emin) / de);
+		int z = std::floor((_events.cosz[i] - zmin) / dz);
+		e = std::max(0, std::min(ne - 1, e));
+		z = std::max(0, std::min(nz - 1, z));
+
+		Nu::Flavor nu_out = Nu::Flavor(_events.flavor[i]);
+		Nu::Flavor nu_E = Nu::Flavor(nu_out / 3 * 3 + Nu::E_);
+		Nu::Flavor nu_M = Nu::Flavor(nu_out / 3 * 3 + Nu::M_);
+		triplets[ResponseChannel(nu_E, nu_out)].emplace_back(_events.bin[i],
+				z * ne + e, _events.weight[i] * _events.factor_E[i]);
+		triplets[ResponseChannel(nu_M, nu_out)].emplace_back(_events.bin[i],
+				z * ne + e, _events.weight[i] * _events.factor_M[i]);
+	}
+
+	_response.assign(triplets.size(), Eigen::SparseMatrix<double>(_nSpectra, ne * nz));
+	size_t nnz = 0;
+	for (size_t c = 0; c < triplets.size(); ++c) {
+		_response[c].setFromTriplets(triplets[c].begin(), triplets[c].end());
+		nnz += _response[c].nonZeros();
+	}
+
+	if (kVerbosity)
+		std::cout << "AtmoSample: response tensor built with " << nnz
+			  << " nonzero elements over " << ne * nz << " true bins" << std::endl;
+}
+
+// the file starts with the number of events, total weight, size of the
+// spectra and the true grid, so that an outdated file is not used
+bool AtmoSample::ReadResponse()
+{
+	if (_response_file.empty())
+		return false;
+
+	std::ifstream in(_response_file.c_str(), std::ios::binary);
+	if (!in.good())
+		return false;
+
+	std::vector<double> key = {double(_events.size()),
+		std::accumulate(_events.weight.begin(), _events.weight.end(), 0.),
+		double(_nSpectra)};
+	key.insert(key.end(), _response_energy.begin(), _response_energy.end());
+	key.insert(key.end(), _response_cosz.begin(), _response_cosz.end());
+
+	std::vector<double> file_key(key.size());
+	in.read(reinterpret_cast<char*>(file_key.data()), key.size() * sizeof(double));
+	if (!in.good() || file_key != key) {
+		std::cout << "AtmoSample: response tensor in " << _response_file
+			  << " does not match the simulation, building it again" << std::endl;
+		return false;
+	}
+
+	const int ne = _response_energy[2], nz = _response_cosz[2];
+	_response_nc.resize(_nSpectra);
+	in.read(reinterpret_cast<char*>(_response_nc.data()), _nSpectra * sizeof(double));
+
+	_response.assign(12, Eigen::SparseMatrix<double>(_nSpectra, ne * nz));
+	for (auto &resp : _response) {
+		int nnz;
+		in.read(reinterpret_cast<char*>(&nnz), sizeof(int));
+		resp.resizeNonZeros(nnz);
+		in.read(reinterpret_cast<char*>(resp.outerIndexPtr()), (ne * nz + 1) * sizeof(int));
+		in.read(reinterpret_cast<char*>(resp.innerIndexPtr()), nnz * sizeof(int));
+		in.read(reinterpret_cast<char*>(resp.valuePtr()), nnz * sizeof(double));
+	}
+
+	if (!in.good()) {
+		std::cout << "AtmoSample: response tensor in " << _response_file
+			  << " is truncated, building it again" << std::endl;
+		return false;
+	}
+
+	if (kVerbosity)
+		std::cout << "AtmoSample: response tensor read from " << _response_file << std::endl;
+	return true;
+}
+
+void AtmoSample::WriteResponse() const
+{
+	if (_response_file.empty())
+		return;
+
+	std::ofstream out(_response_file.c_str(), std::ios::binary);
+	if (!out.good()) {
+		std::cerr << "WARNING - AtmoSample: cannot write response tensor to "
+			  << _response_file << std::endl;
+		return;
+	}
+
+	std::vector<double> key = {double(_events.size()),
+		std::accumulate(_events.weight.begin(), _events.weight.end(), 0.),
+		double(_nSpectra)};
+	key.insert(key.end(), _response_energy.begin(), _response_energy.end());
+	key.insert(key.end(), _response_cosz.begin(), _response_cosz.end());
+
+	out.write(reinterpret_cast<const char*>(key.data()), key.size() * sizeof(double));
+	out.write(reinterpret_cast<const char*>(_response_nc.data()), _nSpectra * sizeof(double));
+
+	// matrices are compressed, in column major order
+	for (const auto &resp : _response) {
+		int nnz = resp.nonZeros();
+		out.write(reinterpret_cast<const char*>(&nnz), sizeof(int));
+		out.write(reinterpret_cast<const char*>(resp.outerIndexPtr()),
+			  (resp.outerSize() + 1) * sizeof(int));
+		out.write(reinterpret_cast<const char*>(resp.innerIndexPtr()), nnz * sizeof(int));
+		out.write(reinterpret_cast<const char*>(resp.valuePtr()), nnz * sizeof(double));
+	}
+
+	if (kVerbosity)
+		std::cout << "AtmoSample: response tensor saved to " << _response_file << std::endl;
+}
+
+// probabilities are taken at the centres of the true bins, for the
+// production height of the atmosphere, with the batched oscillator
+Eigen::VectorXd AtmoSample::ResponseSpectra(std::shared_ptr<Oscillator> osc)
+{
+	_response_ogram->Build(osc, *_atm_path);
+
+	Eigen::VectorXd spectra = _response_nc;
+	for (int sector = 0; sector < 2; ++sector)
+		for (Nu::Flavor in : {Nu::E_, Nu::M_})
+			for (int out = 0; out < 3; ++out) {
+				Nu::Flavor nu_in = Nu::Flavor(3 * sector + in);
+				Nu::Flavor nu_out = Nu::Flavor(3 * sector + out);
+				spectra += _response[ResponseChannel(nu_in, nu_out)]
+					* _response_ogram->Nodes(nu_in, nu_out);
+			}
+
+	return spectra;
+}
+
+// read entry i of the simulation and apply the selection of events
+// returns false if the event is not used, otherwise type and position
+// in the flattened spectra are set and weightx is normalised
+bool AtmoSample::LoadEvent(int i, std::string &type, int &bin)
+{
+	dm->GetEntry(i);	// all branches
+	itype -= 1;
+
+	// uknown event types
+	if (itype < _type_names.begin()->first || itype > _type_names.rbegin()->first)
+		return false;
+
+	// no NC tau's allowed, so skip
+	if (std::abs(mode) >= 30 && std::abs(ipnu) == 16)
+		return false;
+
+	// this is real data, which we do not want
+	if (pnu < 1.0e-7 && ipnu == 0 && mode == 0)
+		return false;
+
+	type = _type_names[itype];
+
+	// bin is not in range, just skip it
+	bin = _reco_hist[type]->FindBin(std::log10(amom), -dir[2]);
+	if ( _reco_hist[type]->IsBinOverflow(bin)
+	  || _reco_hist[type]->IsBinUnderflow(bin))
+		return false;
+
+	// global bin of TH2 is x + (nx + 2) y, and spectra are flattened
+	// along cosz first, as in BuildSamples
+	int xs = _reco_hist[type]->GetNbinsX() + 2;
+	int ys = _reco_hist[type]->GetNbinsY();
+	int x = bin % xs, y = bin / xs;
+	bin = _spectra[type].first + y - 1 + ys * (x - 1);
+
+	weightx *= _weight;
+	if (itype > 70)
+		weightx *= _reduce;
+
+	return true;
+}
+
+// ratio of the other flavour flux to the flux of the event flavour
+void AtmoSample::FluxFactors(double &factor_E, double &factor_M)
+{
+	factor_E = 1;
+	factor_M = 1;
+	if (std::abs(ipnu) == 12)	// it is e type
+		factor_M = flxho[1] / flxho[0];
+	else				// it is mu or tau type
+		factor_E = flxho[0] / flxho[1];
+}
+
+// derivatives of the histograms of BuildSamples, flattened in the same way,
+// with respect to the oscillation parameters, one column each
+// the event loop is the same, but the weights are the derivatives of the
+// oscillated weights, found with Oscillator::ProbabilityGradient
+// NC events do not depend on the oscillation parameters
+std::unordered_map<std::string, Eigen::MatrixXd> AtmoSample::BuildJacobians(std::shared_ptr<Oscillator> osc)
+{
+	Eigen::MatrixXd spectra = Eigen::MatrixXd::Zero(_nSpectra, 6);
+
+	if (kVerbosity)
+		std::cout << "AtmoSample: reading " << _events.size()
+			  << " events for derivatives" << std::endl;
+
+	std::vector<Eigen::MatrixXd> grad;
+	Atmosphere::Profiles profiles;
+	for (size_t i = 0; i < _events.size(); ++i) {
+		if (_events.nc[i])
+			continue;
+
+		double pnu = _events.pnu[i];
+		Nu::Flavor nu_out = Nu::Flavor(_events.flavor[i]);
+		auto jac = spectra.row(_events.bin[i]);
+		// weighted as the probabilities, if there is a quadrature in height
+		// and with the same profiles of BuildSamples, or of the bucket
+		for (const auto &ip : EventProfiles(i, profiles)) {
+			osc->SetMatterProfile(ip.second);
+			osc->ProbabilityGradient(nu_out, pnu, grad);
+
+			for (size_t p = 0; p < grad.size(); ++p)
+				jac(p) += ip.first * _events.weight[i]
+					* (_events.factor_E[i] * grad[p](nu_out % 3, Nu::E_)
+					+  _events.factor_M[i] * grad[p](nu_out % 3, Nu::M_));
+		}
+	}
+
+	// same ordering as the flattened histograms, without under/overflow
+	std::unordered_map<std::string, Eigen::MatrixXd> jacobians;
+	for (const auto &is : _spectra)
+		jacobians[is.first] = spectra.middleRows(is.second.first, is.second.second);
+
+	return jacobians;
 }
 
 Eigen::VectorXd AtmoSample::ConstructSamples(std::shared_ptr<Oscillator> osc)
@@ -608,278 +1235,3 @@ void AtmoSample::LoadReconstruction(std::string channel)
 	inFile->Close();
 }
 */
-
-// Create the histograms using the binning information from card
-// this bins refer to the reconstruction variables, log p and cos zenith
-// loop through MC files and defines true histograms
-// to add -> create card output
-// NOT A MEMBER FUNCTION, to be used as one off
-/*
-void CreateTensor(CardDealer *cd)
-{
-	// type of histogram, they are numbered with integer
-	// to identify the event type in the MC files
-	std::map<std::string, int> hist_types;
-	std::map<std::string, std::vector<double> > hist_axes;
-	cd.Get("bintype_", hist_types);
-	cd.Get("binaxis_", hist_axes);
-
-	// store binning information as TH2D/TH1D
-	// the content will be stored in Eigen matrices
-	// and there will be a mapping with row-column and global bins
-	//
-	std::map<std::string, Eigen::MatrixXd> bin_contents;
-	std::map<std::string, TH2D*> reco_bins, true_bins;	// saving as TH1D pointer!
-	std::map<int, std::string> type_names;
-
-	for (const auto &ih : hist_types) {
-		std::cout << ih.first << " and " << ih.second << std::endl;
-		std::string ax0 = ih.first + "_0";
-		std::string ax1 = ih.first + "_1";
-		std::cout << "sizes " << hist_axes[ax0].size() << ", "
-			  << hist_axes[ax1].size() << std::endl;
-		std::string hname = "reco_" + ih.first;
-		reco_bins[ih.first] = new TH2D (hname.c_str(), hname.c_str(),
-				hist_axes[ax0].size()-1, &hist_axes[ax0][0],
-				hist_axes[ax1].size()-1, &hist_axes[ax1][0]);
-		// reverse lookup
-		type_names[ih.second] = ih.first;
-	}
-
-	std::string chain, friends, tree_name, friend_name;
-	cd.Get("tree_input", chain);
-	cd.Get("tree_name", tree_name);
-	cd.Get("friend_input", friends);
-	cd.Get("friend_name", friend_name);
-
-	TChain *dm = new TChain(tree_name.c_str());
-	TChain *fr = new TChain(friend_name.c_str());
-
-	dm->Add(chain.c_str());
-	fr->Add(friends.c_str());
-
-	dm->AddFriend(friend_name.c_str());
-
-	int ipnu, mode, itype;
-	float dirnu[3], dir[3], flxho[3];
-	float pnu, amom, weightx, ErmsHax, nEAveHax;
-
-	dm->SetBranchAddress("ipnu",    &ipnu);	//pdg
-	dm->SetBranchAddress("mode",    &mode);
-	dm->SetBranchAddress("itype",   &itype);
-
-	dm->SetBranchAddress("dirnu",   dirnu);
-	dm->SetBranchAddress("pnu",     &pnu);
-	dm->SetBranchAddress("dir",     dir);
-	dm->SetBranchAddress("amom",    &amom);
-	dm->SetBranchAddress("flxho",   &flxho);
-	dm->SetBranchAddress("weightx", &weightx);
-
-	// only if friends
-	//dm->SetBranchAddress("ErmsHax",  ErmsHax  );
-	//dm->SetBranchAddress("nEAveHax", nEAveHax );
-
-	dm->SetBranchStatus("*", 0);
-	dm->SetBranchStatus("dirnu", 1);
-	dm->SetBranchStatus("pnu", 1);
-	dm->SetBranchStatus("ipnu", 1);
-
-	// loop first...
-	// zenith angle will be always between -1 and 1
-	// find max and min values of true energy information
-	// group by pdg value
-	//std::map<int, double> E_min, E_max;
-	//for (int i = 0; i < dm->GetEntries(); ++i) {
-	//	dm->GetEntry(i);
-
-	//	pnu = log10(pnu) + 3;
-	//	if (!E_min.count(ipnu) || E_min[ipnu] > pnu)
-	//		E_min[ipnu] = pnu;
-	//	if (!E_max.count(ipnu) || E_max[ipnu] < pnu)
-	//		E_max[ipnu] = pnu;
-	//}
-	//for (const auto &it : E_min)
-	//	std::cout << "energy lim " << it.first
-	//		  << " = " << it.second
-	//		  << " : " << E_max[it.first] << std::endl;
-	// type_names is map type(int) and hist name(str) pairs
-
-	// ready to fill histograms
-	// create matrices for bin contents
-
-	std::vector<int> nu_types = {-16, -14, -12, 12, 14, 16};
-	int trueX, trueY;
-	if (!cd.Get("true_bins_energy", trueX))
-		trueX = 100;
-	if (!cd.Get("true_bins_cosz", trueY))
-		trueY = 50;
-
-	// type names is <int, string>
-	for (const auto &ir : type_names) {
-		// 100 bins in true neutrino energy and 50 bins in cosz
-		std::string hname = "true_" + ir.second;
-		true_bins[ir.second] = new TH2D(hname.c_str(), hname.c_str(),
-					trueX, 1, 8, //it.second, E_max[it.first],
-					trueY, -1, 1);	// -1 < cosz < 1
-		// granularity of true bins is fixed
-		// but eventually should be defined in card file
-
-		int ny = reco_bins[ir.second]->GetNbinsX() * 
-			 reco_bins[ir.second]->GetNbinsY();
-
-		int nx = trueX * trueY;
-
-		std::cout << "hist " << ir.second << "\t" << ny << ", " << nx << std::endl;
-		for (int it : nu_types) {
-			std::string name = Nu::toString(it);
-			// one bin content per neutrino initial flavor
-			if (it > 0) {
-				bin_contents[ir.second + "_nuE0_" + name]
-						= Eigen::MatrixXd::Zero(ny, nx);
-				bin_contents[ir.second + "_nuM0_" + name]
-						= Eigen::MatrixXd::Zero(ny, nx);
-			}
-			else {
-				bin_contents[ir.second + "_nuEB_" + name]
-						= Eigen::MatrixXd::Zero(ny, nx);
-				bin_contents[ir.second + "_nuMB_" + name]
-						= Eigen::MatrixXd::Zero(ny, nx);
-			}
-		}
-	}
-
-	// maps are sorted
-	// type names is <int, string>, makes event by event look up easier
-	int first_event_type = type_names.begin()->first;
-	int last_event_type = type_names.rbegin()->first;
-
-	double scale;
-	if (!cd.Get("MC_scale", scale))
-		scale = 188.4 / 22.5;	// HK to SK ratio
-	dm->SetBranchStatus("*", 1);
-	// loop through all events and fill histograms
-	for (int i = 0; i < dm->GetEntries(); ++i) {
-		dm->GetEntry(i);	// all branches
-		itype -= 1;
-		weightx *= scale;
-
-		// uknown event types
-		if (itype < first_event_type || itype > last_event_type)
-			continue;
-
-		// no NC tau's allowed, so skip
-		if (std::abs(mode) > 30 && std::abs(ipnu) == 16)
-			continue;
-
-		// this is real data, which we do not want
-		if (pnu < 1.0e-7 && ipnu == 0 && mode == 0)
-			continue;
-
-		// using these four variables to determine bin and EventType
-		//pnu  > 0 ? log10(pnu) + 3 : 0;	// GeV
-		//amom > 0 ? log10(amom)    : 0;	// already in GeV
-		//cosnu = dirnu[2];
-		//coslp = dir[2];
-
-		std::string type = type_names[itype];
-
-		// global bin of event in true and reco histograms
-		int glo_nr = reco_bins[type]->FindFixBin(log10(amom), dir[2]);
-		int glo_nt = true_bins[type]->FindFixBin(log10(pnu)+3, dirnu[2]);
-
-		// total number of bins on x direction to find the absolut bin
-		int r_nx = reco_bins[type]->GetNbinsX() + 2;
-		int r_ny = reco_bins[type]->GetNbinsY() + 1;
-		int t_nx = true_bins[type]->GetNbinsX() + 2;
-		int t_ny = true_bins[type]->GetNbinsY() + 1;
-
-		// means global bin is underflow or overflow, so event is discarded
-		if (glo_nr < r_nx || glo_nr > r_nx * r_ny - 1
-		 || glo_nr % r_nx == 0 || glo_nr % r_nx == r_nx - 1)
-			continue;
-		if (glo_nr < t_nx || glo_nr > t_nx * t_ny - 1
-		 || glo_nr % t_nx == 0 || glo_nr % t_nx == t_nx - 1)
-			continue;
-
-		// absolute bins of the matrix
-		// rows of matrix
-		int loc_nr = glo_nr - (r_nx - 1 + 2 * (glo_nr / r_nx));
-		// columns of matrix
-		int loc_nt = glo_nt - (t_nx - 1 + 2 * (glo_nt / t_nx));
-
-
-		std::string name = Nu::toString(ipnu);
-
-		double factor_E = 1, factor_M = 1;
-		if (name.find("nuE") != std::string::npos)	// it is e type
-      			factor_E = flxho[1] / flxho[0];
-		else						// it is mu or tau type
-      			factor_M = flxho[0] / flxho[1];
-
-		if (ipnu > 0) {	// neutrino
-			bin_contents[type + "_nuE0_" + name](loc_nr, loc_nt)
-							+= weightx * factor_E;
-			bin_contents[type + "_nuM0_" + name](loc_nr, loc_nt)
-							+= weightx * factor_M;
-		}
-		else {		//antineutrino
-			bin_contents[type + "_nuEB_" + name](loc_nr, loc_nt)
-							+= weightx * factor_E;
-			bin_contents[type + "_nuMB_" + name](loc_nr, loc_nt)
-							+= weightx * factor_M;
-		}
-	}
-
-	// save histograms and matrices
-	std::string outpath, cardpath;
-	cd.Get("output_path", outpath);
-	cd.Get("card_path", cardpath);
-	if (outpath.find(".root") == std::string::npos)
-		outpath += ".root";
-	if (cardpath.find(".card") == std::string::npos)
-		cardpath += ".card";
-	// type names is <int, string>
-	for (const auto &ir : type_names) {
-
-		std::string outf = outpath;
-		outf.insert(outf.find(".root"), ir.second); 
-		std::string card = cardpath;
-		card.insert(card.find(".card"), ir.second); 
-
-		TFile outp(outf.c_str(), "RECREATE");
-		std::ofstream cf(card.c_str());
-
-		// name is histogram type
-		reco_bins[ir.second]->Write();
-		cf << "reco_info\t\"" << reco_bins[ir.second]->GetName() << "\"\n";
-		// name is histogram type + "_" + nu flavor
-		true_bins[ir.second]->Write();
-		cf << "true_info\t\"" << true_bins[ir.second]->GetName() << "\"\n";
-
-		cf << "type\t\"" << ir.second << "\"\n" << std::endl;
-		for (const auto &ib : bin_contents) {
-				continue;
-			TMatrixD *content = new TMatrixD(ib.second.rows(),
-							 ib.second.cols(),
-							 ib.second.data());
-
-			content->Write(ib.first.c_str());
-		}
-
-		cf << "\n\nreco_path\t\"" << outf << "\"" << std::endl;
-
-		outp.Close();
-		cf.close();
-	}
-	// ROOT should automatically delete memory of pointer
-	// when closing file, unless something was not written
-
-	// just to be safe, delete everything
-	for (auto &ih : reco_bins)
-		delete ih.second;
-	for (auto &ih : true_bins)
-		delete ih.second;
-
-	bin_contents.clear();
-}
-*/
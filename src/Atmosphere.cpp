@@ -9,6 +9,8 @@ Atmosphere::Atmosphere(const std::string &card) :
 
 	LoadDensityProfile(cd);
 	LoadProductionHeights(cd);
+	MergeLayers(cd);
+	CacheProfiles(cd);
 }
 
 Atmosphere::Atmosphere(const CardDealer &cd) :
@@ -19,6 +21,8 @@ Atmosphere::Atmosphere(const CardDealer &cd) :
 
 	LoadDensityProfile(cd);
 	LoadProductionHeights(cd);
+	MergeLayers(cd);
+	CacheProfiles(cd);
 }
 
 
@@ -30,6 +34,36 @@ Atmosphere::Atmosphere(CardDealer *cd) :
 
 	LoadDensityProfile(*cd);
 	LoadProductionHeights(*cd);
+	MergeLayers(*cd);
+	CacheProfiles(*cd);
+}
+
+// nodes and weights of the Gauss-Legendre quadrature of n points
+// mapped from [-1, 1] to [0, 1], nodes are found with Newton's method
+// on the Legendre polynomial of order n, with the recurrence relation
+static void GaussLegendre(int n, std::vector<double> &x, std::vector<double> &w)
+{
+	x.resize(std::max(n, 0));
+	w.resize(std::max(n, 0));
+	for (int i = 0; i < n; ++i) {
+		double z = std::cos(Const::pi * (i + 0.75) / (n + 0.5));
+		double dp = 1;
+		for (int it = 0; it < 100; ++it) {
+			double p0 = 1, p1 = 0;
+			for (int k = 1; k <= n; ++k) {
+				double p2 = p1;
+				p1 = p0;
+				p0 = ((2 * k - 1) * z * p1 - (k - 1) * p2) / k;
+			}
+			dp = n * (z * p0 - p1) / (z * z - 1);
+			double dz = p0 / dp;
+			z -= dz;
+			if (std::abs(dz) < 1e-15)
+				break;
+		}
+		x[i] = (1 - z) / 2.;
+		w[i] = 1. / ((1 - z * z) * dp * dp);
+	}
 }
 
 // loads production heights calculated by Honda (HKKM2014) 
@@ -48,6 +82,12 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 	if (!cd.Get("production_height", _atm))
 		_atm = 15.0;	// default 15 km altitude
 
+	// instead of one random height, average over fixed quantiles
+	int quad;
+	if (!cd.Get("height_quadrature", quad))
+		quad = 0;
+	GaussLegendre(quad, _quad_p, _quad_w);
+
 	// vector with the discretised probabilities
 	_problibs.clear();
 	// vector with the discretised log energy bins !
@@ -68,16 +108,15 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 			[](double b) { return -0.1 * b; }); 
 	// now zenith_bin is 0.9, 0.8, ... -0.9, -1.0	according to Honda binning
 
-	std::map<int, std::vector<double> > *table;	// "reference"
+	// rows of each flavour in order of cosz and energy, as in the files
+	std::array<std::vector<double>, 4> tables;
+	std::vector<double> *table = nullptr;	// "reference"
 	for (const std::string &prod : prod_files) {
 		std::ifstream ip(prod.c_str());
 		if (kVerbosity)
 			std::cout << "Atmosphere: loading production file " << prod << std::endl;
 		std::string line;
 
-		//int iz = 0;	// zenith index
-		int ie = 0;	// energy index
-
 		bool fill_energy = false;
 		while (std::getline(ip, line)) {
 			// remove hash comments
@@ -95,20 +134,21 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 
 			if (row.size() == 25) {	// header
 				fill_energy = !_energies.size();
+				table = nullptr;
 				if (int(row[0]) != 1)
 					continue;
 				switch (int(row[1])) {	// nu flavor
 					case 1: // nu mu
-						table = &nuM0_table;
+						table = &tables[1];
 						break;
 					case 2: // nu mu bar
-						table = &nuMb_table;
+						table = &tables[3];
 						break;
 					case 3: // nu e
-						table = &nuE0_table;
+						table = &tables[0];
 						break;
 					case 4: // nu e bar
-						table = &nuEb_table;
+						table = &tables[2];
 						break;
 				}
 
@@ -124,11 +164,12 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 				if (fill_energy)	// store energy bin information
 					_energies.push_back(log10(row[0]));
 
+				if (!table)
+					continue;
+
 				std::transform(row.begin()+1, row.end(), row.begin() + 1,
 						[](double b) { return b / 1.e3; }); // m -> km
-				//int global_bin = iz * (row.size() - 1) + ie;
-				(*table)[ie].assign(row.begin()+1, row.end());
-				++ie;
+				table->insert(table->end(), row.begin() + 1, row.end());
 			}
 			else
 				std::cerr << "did you tamper with Honda's inputs?\n";
@@ -136,11 +177,249 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 		ip.close();
 	}
 
+	_stride_e = _problibs.size();
+	_stride_c = _stride_e * _energies.size();
+	_stride_f = _stride_c * _zenithas.size();
+
+	_heights.clear();
+	_heights.reserve(tables.size() * _stride_f);
+	for (const auto &t : tables) {
+		if (t.size() != _stride_f)
+			throw std::invalid_argument("Atmosphere: production height tables "
+					"must have all flavours, zenith angles, and energies");
+		_heights.insert(_heights.end(), t.begin(), t.end());
+	}
+
 	//cmd = "rm .production_files";
 	//system(cmd.c_str());
 }
 
 
+// the oscillator is set with the parameters of the card, or the defaults
+// of Oscillator::AutoSet, and it is used only to check the merging
+void Atmosphere::MergeLayers(const CardDealer &cd)
+{
+	double threshold;
+	if (!cd.Get("merge_layers", threshold) || threshold <= 0)
+		return;
+
+	std::shared_ptr<Oscillator> osc(new Oscillator(cd));
+	osc->AutoSet(cd);
+	MergeLayers(osc, threshold);
+}
+
+// merged shells become one layer with the total length and the same
+// column densities of matter and electrons, see MatterProfile
+// the probabilities are compared on a grid of upgoing cosz and energies
+// from 0.1 to 100 GeV, and at each step the two adjacent groups of shells
+// with the closest densities that can be merged within threshold are merged,
+// until no more groups can be merged
+double Atmosphere::MergeLayers(std::shared_ptr<Oscillator> osc, double threshold)
+{
+	std::vector<double> coszs(40);
+	for (size_t c = 0; c < coszs.size(); ++c)
+		coszs[c] = -1 + (c + 0.5) / coszs.size();
+	// plus one path for each shell, with the closest approach in the
+	// middle of the shell, so that also the inner ones are tested
+	for (size_t k = 1; k < _profile.size(); ++k) {
+		double mid = (_profile[k-1][0] + _profile[k][0]) / 2. / Const::EarthR;
+		if (mid < 1)
+			coszs.push_back(-sqrt(1 - mid * mid));
+	}
+	std::sort(coszs.begin(), coszs.end());
+	const Eigen::ArrayXd energies = Eigen::pow(10.,
+			Eigen::ArrayXd::LinSpaced(40, -1, 2));
+
+	// probabilities with the full profile, for both sectors
+	_group.clear();
+	std::vector<Eigen::ArrayXXd> full;
+	std::vector<size_t> layers;
+	for (double cosz : coszs) {
+		const Oscillator::Profile profile = MatterProfile(cosz, _atm);
+		layers.push_back(profile.size());
+		osc->SetMatterProfile(profile);
+		for (int sector = 0; sector < 2; ++sector)
+			full.push_back(osc->ProbabilityMatrix(Nu::Flavor(3 * sector), energies));
+	}
+
+	// each shell starts in its own group, labeled by its first shell
+	_group.resize(_profile.size());
+	std::iota(_group.begin(), _group.end(), 0);
+
+	// a boundary that cannot be merged is tried again only
+	// if one of the two groups around it has changed
+	std::vector<bool> rejected(_group.size(), false);
+
+	double err = 0;
+	while (true) {
+		// boundaries between groups, by difference in mean density
+		std::vector<std::pair<double, size_t> > bounds;
+		for (size_t k = 1; k < _group.size(); ++k) {
+			if (_group[k] == _group[k-1] || rejected[k])
+				continue;
+			double rho[2] = {0, 0}, vol[2] = {0, 0};
+			for (size_t j = 0; j < _group.size(); ++j) {
+				int g = _group[j] == _group[k-1] ? 0 : _group[j] == _group[k] ? 1 : -1;
+				if (g < 0)
+					continue;
+				double dv = pow(_profile[j][0], 3) - (j ? pow(_profile[j-1][0], 3) : 0.);
+				rho[g] += _profile[j][1] * dv;
+				vol[g] += dv;
+			}
+			// shells of no volume, as the centre, take the next density
+			if (!vol[0])
+				rho[0] = _profile[k-1][1], vol[0] = 1;
+			bounds.emplace_back(std::abs(rho[0] / vol[0] - rho[1] / vol[1]), k);
+		}
+		std::sort(bounds.begin(), bounds.end());
+
+		bool merged = false;
+		for (const auto &ib : bounds) {
+			std::vector<int> group = _group;
+			std::replace(_group.begin(), _group.end(), _group[ib.second], _group[ib.second - 1]);
+
+			// only paths crossing the new group are changed
+			size_t last = ib.second;
+			while (last + 1 < _group.size() && _group[last + 1] == _group[ib.second])
+				++last;
+			double e = MergeError(osc, coszs, energies, full, _profile[last][0]);
+			if (e < threshold) {
+				err = std::max(err, e);
+				merged = true;
+				// boundaries around the new group
+				size_t first = std::find(_group.begin(), _group.end(),
+							 _group[ib.second]) - _group.begin();
+				rejected[first] = false;
+				if (last + 1 < _group.size())
+					rejected[last + 1] = false;
+				break;
+			}
+			_group.swap(group);
+			rejected[ib.second] = true;
+		}
+
+		if (!merged)
+			break;
+	}
+
+	if (kVerbosity) {
+		std::set<int> groups(_group.begin(), _group.end());
+		std::cout << "Atmosphere: " << _profile.size() << " shells merged in "
+			  << groups.size() << " layers, probabilities differ by at most "
+			  << err << " from the full profile\n"
+			  << "Atmosphere: layers crossed by cosz, full and merged\n";
+		for (size_t c = 0; c < coszs.size(); c += 5)
+			std::cout << "\t" << coszs[c] << "\t" << layers[c] << "\t"
+				  << MatterProfile(coszs[c], _atm).size() << "\n";
+	}
+
+	return err;
+}
+
+double Atmosphere::MergeError(std::shared_ptr<Oscillator> osc,
+			      const std::vector<double> &coszs, const Eigen::ArrayXd &energies,
+			      const std::vector<Eigen::ArrayXXd> &full, double radius)
+{
+	double err = 0;
+	for (size_t c = 0; c < coszs.size(); ++c) {
+		// the path does not reach radius
+		if (Const::EarthR * sqrt(1 - coszs[c] * coszs[c]) >= radius)
+			continue;
+		osc->SetMatterProfile(MatterProfile(coszs[c], _atm));
+		for (int sector = 0; sector < 2; ++sector) {
+			const Eigen::ArrayXXd prob = osc->ProbabilityMatrix
+				(Nu::Flavor(3 * sector), energies);
+			err = std::max(err, (prob - full[2 * c + sector]).abs().maxCoeff());
+		}
+	}
+	return err;
+}
+
+// the Earth part of a profile depends only on cosz and the height
+// changes the length in air, so cosz and heights are quantized to the
+// nodes of a grid and the profiles are built once for each node
+// the grid is given by the number of bins in cosz and the step in height
+// up to the highest production height, the error from quantization
+// is estimated by comparing each node with the exact profiles at the
+// corners of its cell
+void Atmosphere::CacheProfiles(const CardDealer &cd)
+{
+	_cache.clear();
+	_cache_len_err = _cache_col_err = 0;
+
+	std::vector<double> grid;
+	if (!cd.Get("profile_cache", grid))
+		return;
+	if (grid.size() < 2 || grid[0] < 2 || grid[1] <= 0)
+		throw std::invalid_argument("Atmosphere: profile_cache needs number "
+				"of bins in cosz and step in height");
+
+	double hmax = _atm;
+	if (_heights.size())
+		hmax = std::max(hmax, *std::max_element(_heights.begin(), _heights.end()));
+
+	_cache_nz = grid[0];
+	_cache_dh = grid[1];
+	_cache_nh = int(std::ceil(hmax / _cache_dh)) + 1;
+
+	_cache.reserve(_cache_nz * _cache_nh);
+	const double dz = 2. / _cache_nz;
+	for (int z = 0; z < _cache_nz; ++z)
+		for (int h = 0; h < _cache_nh; ++h) {
+			double cosz = -1 + dz * (z + 0.5);
+			double atm = _cache_dh * h;
+			Oscillator::Profile node = MatterProfile(cosz, atm);
+			_cache.push_back(node);
+
+			double len = Oscillator::Length(node);
+			double col = len * Oscillator::ElectronDensity(node);
+			// just inside the edges of the cell
+			for (double cz : {cosz - dz * 0.499, cosz + dz * 0.499})
+				for (double ah : {atm - _cache_dh / 2., atm + _cache_dh / 2.}) {
+					Oscillator::Profile exact = MatterProfile(cz, std::max(ah, 0.));
+					double l = Oscillator::Length(exact);
+					double c = l * Oscillator::ElectronDensity(exact);
+					_cache_len_err = std::max(_cache_len_err, std::abs(l - len));
+					_cache_col_err = std::max(_cache_col_err, std::abs(c - col));
+				}
+		}
+
+	size_t layers = 0;
+	for (const auto &p : _cache)
+		layers += p.size();
+
+	if (kVerbosity)
+		std::cout << "Atmosphere: " << _cache.size() << " profiles cached, "
+			  << _cache_nz << " in cosz and " << _cache_nh << " in height, "
+			  << layers * sizeof(Oscillator::LDY) / 1048576. << " MB, "
+			  << "differences up to " << _cache_len_err << " km in length and "
+			  << _cache_col_err << " km g/cm3 in electron column" << std::endl;
+}
+
+int Atmosphere::ProfileIndex(double cosz, double atm) const
+{
+	if (_cache.empty())
+		return -1;
+
+	if (atm < 0)
+		atm = _atm;
+
+	int z = std::max(0, std::min(_cache_nz - 1, int((cosz + 1.) / 2. * _cache_nz)));
+	int h = std::max(0, std::min(_cache_nh - 1, int(std::lround(atm / _cache_dh))));
+	return z * _cache_nh + h;
+}
+
+const Oscillator::Profile &Atmosphere::CachedProfile(int index) const
+{
+	return _cache.at(index);
+}
+
+double Atmosphere::CacheError(double &length) const
+{
+	length = _cache_len_err;
+	return _cache_col_err;
+}
+
 // Load matter density profile from file
 // the profile is saved as an array[3] of at least 2 elements, but it can be 3 too
 // columns above 3 are discarded
@@ -151,6 +430,7 @@ void Atmosphere::LoadProductionHeights(const CardDealer &cd)
 void Atmosphere::LoadDensityProfile(const CardDealer &cd, std::string table_file)
 {
 	_profile.clear();
+	_group.clear();
 
 	if (table_file.empty())
 		if (!cd.Get("density_profile", table_file))
@@ -221,44 +501,79 @@ void Atmosphere::LoadDensityProfile(const CardDealer &cd, std::string table_file
 // 	cosine zenith
 // 	energy
 double Atmosphere::RandomHeight(Nu::Flavor flv, double cosz, double energy)
+{
+	return RandomHeight(flv, cosz, energy, gen);
+}
+
+double Atmosphere::RandomHeight(Nu::Flavor flv, double cosz, double energy,
+				Philox &rng) const
 {
 	// no random heights file loaded
 	if (!_problibs.size())
 		return -1;
 
+	// define a probability interval first
+	std::uniform_real_distribution<> uniform(0, 1);//uniform distribution between 0 and 1
+	return Height(flv, cosz, energy, uniform(rng));
+}
+
+// the cumulative distributions are inverted by interpolation
+double Atmosphere::Height(Nu::Flavor flv, double cosz, double energy, double prob) const
+{
+	Cell cell;
+	if (!Locate(flv, cosz, energy, cell))
+		return -1;
+	return Interpolate(cell, prob);
+}
+
+void Atmosphere::Heights(Nu::Flavor flv, double cosz, double energy,
+			 const std::vector<double> &probs, std::vector<double> &heights) const
+{
+	heights.resize(probs.size());
+
+	Cell cell;
+	if (!Locate(flv, cosz, energy, cell))
+		std::fill(heights.begin(), heights.end(), -1);
+	else
+		for (size_t i = 0; i < probs.size(); ++i)
+			heights[i] = Interpolate(cell, probs[i]);
+}
+
+// find the rows of the tables around cosz and energy, false if out of range
+bool Atmosphere::Locate(Nu::Flavor flv, double cosz, double energy, Cell &cell) const
+{
+	// no random heights file loaded
+	if (!_problibs.size())
+		return false;
+
 	energy = log10(energy);
 	if (energy >= _energies.back()) // error energy >~ 1e4
-		return -1;
+		return false;
 	if (cosz < _zenithas.back())	// error cosz < -1
-		return -1;
+		return false;
 
-	// get reference to correct table
-	std::map<int, std::vector<double> > *table;	// "reference"
+	// get offset of correct table
+	size_t table;
 	switch (flv) {	// nu flavor
 		case Nu::M_: // nu mu
 		case Nu::T_: // nu mu
-			table = &nuM0_table;
+			table = 1;
 			break;
 		case Nu::Mb: // nu mu bar
 		case Nu::Tb: // nu mu bar
-			table = &nuMb_table;
+			table = 3;
 			break;
 		case Nu::E_: // nu e
-			table = &nuE0_table;
+			table = 0;
 			break;
 		case Nu::Eb: // nu e bar
-			table = &nuEb_table;
+			table = 2;
 			break;
 		default:
 			throw std::invalid_argument("Undefine neutrino flavour\n");
 			break;
 	}
 
-	// define a probability interval first
-	std::uniform_real_distribution<> uniform(0, 1);//uniform distribution between 0 and 1
-	double prob = uniform(gen);
-	auto ip = std::lower_bound(_problibs.begin(), _problibs.end(), prob);
-	
 	// energy is ordered increasing
 	auto ie = std::lower_bound(_energies.begin(), _energies.end(), energy);
 	// zenith is ordered decreasing
@@ -267,11 +582,6 @@ double Atmosphere::RandomHeight(Nu::Flavor flv, double cosz, double energy)
 	// iterators are the least elements that compare to input
 	// if iterator points to begin, move to second
 	// if iterator points to end, move them to last valid
-	if (ip == _problibs.begin())
-		++ip;
-	else if (ip == _problibs.end())
-		--ip;
-
 	if (ie == _energies.begin())
 		++ie;
 	else if (ie == _energies.end())
@@ -282,51 +592,52 @@ double Atmosphere::RandomHeight(Nu::Flavor flv, double cosz, double energy)
 	else if (ic == _zenithas.end())
 		--ic;
 
-	//if (ip == _problibs.end() || ip == std::prev(_problibs.end()))
-	//	ip = _problibs.end() - 2;
-	//if (ie == _energies.end() || ie == std::prev(_energies.end()))
-	//	ie = _energies.end() - 2;
-	//if (ic == _zenithas.end() || ic == std::prev(_zenithas.end()))
-	//	ic = _zenithas.end() - 2;
-
 	// index positions
-	int pn = std::distance(_problibs.begin(), ip);
-	int en = std::distance(_energies.begin(), ie);
-	int cn = std::distance(_zenithas.begin(), ic);
+	size_t en = std::distance(_energies.begin(), ie);
+	size_t cn = std::distance(_zenithas.begin(), ic);
 
-	// Trilinear interpolation
-	// https://en.wikipedia.org/wiki/Trilinear_interpolation
 	// with respect to following element
-	double pd = (prob   - *ip) / (*std::prev(ip) - *ip);
-	double ed = (energy - *ie) / (*std::prev(ie) - *ie);
-	double cd = (cosz   - *ic) / (*std::prev(ic) - *ic);
+	cell.ed = (energy - *ie) / (*std::prev(ie) - *ie);
+	cell.cd = (cosz   - *ic) / (*std::prev(ic) - *ic);
 	// meaning of values [0,1] is proximity to following element
 
-	// x direction is prob,
-	// y direction is energy
-	// z direction is cosz
-	// Production height is a function of
-	// 	probability (for PDF), energy, cosz
-
-	double h000 = (*table)[_energies.size() *  cn    + en  ][pn  ];
-	double h001 = (*table)[_energies.size() *  cn    + en  ][pn-1];
-	double h010 = (*table)[_energies.size() *  cn    + en-1][pn  ];
-	double h011 = (*table)[_energies.size() *  cn    + en-1][pn-1];
-	double h100 = (*table)[_energies.size() * (cn-1) + en  ][pn  ];
-	double h101 = (*table)[_energies.size() * (cn-1) + en  ][pn-1];
-	double h110 = (*table)[_energies.size() * (cn-1) + en-1][pn  ];
-	double h111 = (*table)[_energies.size() * (cn-1) + en-1][pn-1];
-
-	double h00 = h000 * (1 - pd) + h100 * pd;
-	double h01 = h001 * (1 - pd) + h101 * pd;
-	double h10 = h010 * (1 - pd) + h110 * pd;
-	double h11 = h011 * (1 - pd) + h111 * pd;
-
-	double h0 = h00 * (1 - ed) + h10 * ed;
-	double h1 = h01 * (1 - ed) + h11 * ed;
+	size_t base = table * _stride_f;
+	cell.row[0] = base +  cn      * _stride_c +  en      * _stride_e;
+	cell.row[1] = base +  cn      * _stride_c + (en - 1) * _stride_e;
+	cell.row[2] = base + (cn - 1) * _stride_c +  en      * _stride_e;
+	cell.row[3] = base + (cn - 1) * _stride_c + (en - 1) * _stride_e;
+
+	return true;
+}
+
+// Trilinear interpolation
+// https://en.wikipedia.org/wiki/Trilinear_interpolation
+// production height is a function of
+// 	probability (for PDF), energy, cosz
+// the position in energy and cosz is given by the cell
+double Atmosphere::Interpolate(const Cell &cell, double prob) const
+{
+	auto ip = std::lower_bound(_problibs.begin(), _problibs.end(), prob);
+	if (ip == _problibs.begin())
+		++ip;
+	else if (ip == _problibs.end())
+		--ip;
+
+	size_t pn = std::distance(_problibs.begin(), ip);
+	double pd = (prob - *ip) / (*std::prev(ip) - *ip);
+
+	// each corner along probability first
+	double h[4];
+	for (int k = 0; k < 4; ++k)
+		h[k] = _heights[cell.row[k] + pn] * (1 - pd)
+		     + _heights[cell.row[k] + pn - 1] * pd;
+
+	// then energy
+	double h0 = h[0] * (1 - cell.ed) + h[1] * cell.ed;
+	double h1 = h[2] * (1 - cell.ed) + h[3] * cell.ed;
 
 	// this is the interpolated value
-	return h0 * (1 - cd) + h1 * cd;
+	return h0 * (1 - cell.cd) + h1 * cell.cd;
 }
 
 // calculate the matter profile for neutrino passage
@@ -334,12 +645,77 @@ double Atmosphere::RandomHeight(Nu::Flavor flv, double cosz, double energy)
 // 	atm  = production height in atmosphere
 // return a vector of length-density pairs in order of neutrino travel baseline
 // the first entry will be therefore atmospheric propagation
+// if the profiles are cached, the nearest one is returned
 Oscillator::Profile Atmosphere::MatterProfile(Nu::Flavor flv, double cosz, double energy)
 {
-	return MatterProfile(cosz, RandomHeight(flv, cosz, energy));
+	return MatterProfile(flv, cosz, energy, gen);
 }
 
-Oscillator::Profile Atmosphere::MatterProfile(double cosz, double atm)
+Oscillator::Profile Atmosphere::MatterProfile(Nu::Flavor flv, double cosz, double energy,
+					      Philox &rng) const
+{
+	double atm = RandomHeight(flv, cosz, energy, rng);
+	if (_cache.size())
+		return CachedProfile(ProfileIndex(cosz, atm));
+	return MatterProfile(cosz, atm);
+}
+
+int Atmosphere::Quadrature() const
+{
+	return _problibs.size() ? _quad_p.size() : 0;
+}
+
+// the heights of the quadrature depend only on flavour, cosz, and energy
+// so the same profiles are found for an event at every call
+Atmosphere::Profiles Atmosphere::MatterProfiles(Nu::Flavor flv, double cosz, double energy)
+{
+	if (Quadrature())
+		return MatterProfiles(flv, cosz, energy, gen);
+	return {std::make_pair(1., MatterProfile(flv, cosz, energy))};
+}
+
+Atmosphere::Profiles Atmosphere::MatterProfiles(Nu::Flavor flv, double cosz, double energy,
+						Philox &rng) const
+{
+	if (!Quadrature())
+		return {std::make_pair(1., MatterProfile(flv, cosz, energy, rng))};
+
+	std::vector<double> heights;
+	Heights(flv, cosz, energy, _quad_p, heights);
+
+	Profiles profiles;
+	profiles.reserve(_quad_p.size());
+	for (size_t q = 0; q < _quad_p.size(); ++q)
+		profiles.emplace_back(_quad_w[q], _cache.size()
+				? CachedProfile(ProfileIndex(cosz, heights[q]))
+				: MatterProfile(cosz, heights[q]));
+	return profiles;
+}
+
+void Atmosphere::ProfileIndices(Nu::Flavor flv, double cosz, double energy,
+				std::vector<std::pair<double, int> > &indices)
+{
+	ProfileIndices(flv, cosz, energy, indices, gen);
+}
+
+void Atmosphere::ProfileIndices(Nu::Flavor flv, double cosz, double energy,
+				std::vector<std::pair<double, int> > &indices,
+				Philox &rng) const
+{
+	indices.clear();
+	if (!Quadrature()) {
+		indices.emplace_back(1., ProfileIndex(cosz, RandomHeight(flv, cosz, energy, rng)));
+		return;
+	}
+
+	Cell cell;
+	bool valid = Locate(flv, cosz, energy, cell);
+	for (size_t q = 0; q < _quad_p.size(); ++q)
+		indices.emplace_back(_quad_w[q], ProfileIndex(cosz,
+				valid ? Interpolate(cell, _quad_p[q]) : -1));
+}
+
+Oscillator::Profile Atmosphere::MatterProfile(double cosz, double atm) const
 {
 	if (atm < 0)
 		atm = _atm;
@@ -368,14 +744,27 @@ Oscillator::Profile Atmosphere::MatterProfile(double cosz, double atm)
 	auto ir = std::lower_bound(_profile.begin(), _profile.end(), dist,
 				  [](const Oscillator::LDY &ldy, double v)
 				  	{ return ldy[0] < v; });
-	for ( ; ir != _profile.end(); ++ir) {
-		Oscillator::LDY &ldy = *ir;
+	for (int last = -1; ir != _profile.end(); ++ir) {
+		const Oscillator::LDY &ldy = *ir;
 		if (std::abs(ldy[0] - dist) < 1e-9)
 			continue;
 		// find track length inside this shell
 		double x_n = sqrt(pow(ldy[0], 2) - pow(dist, 2)) - x_prev;
-		halves.push_back({x_n, ldy[1], ldy[2]});
 		x_prev += x_n;
+
+		// shells merged with the previous one keep the column densities
+		int group = _group.size() ? _group[ir - _profile.begin()] : -1;
+		if (group >= 0 && group == last) {
+			Oscillator::LDY &ml = halves.back();
+			double col = ml[0] * ml[1] + x_n * ldy[1];
+			double ecol = ml[0] * ml[1] * ml[2] + x_n * ldy[1] * ldy[2];
+			ml[0] += x_n;
+			ml[1] = col / ml[0];
+			ml[2] = col > 0 ? ecol / col : 0.5;
+		}
+		else
+			halves.push_back({x_n, ldy[1], ldy[2]});
+		last = group;
 	}
 
 	if (halves.size()) { // double the deepest length
@@ -283,9 +283,26 @@ void BeamSample::LoadReconstruction(std::string reco_file)
 std::unordered_map<std::string, Eigen::VectorXd>
 	BeamSample::BuildSamples(std::shared_ptr<Oscillator> osc)
 {
-	if (osc)
+	if (osc) {
 		osc->SetMatterProfile(_lens_dens);
 
+		// all bin centres are registered as precomputed energies
+		// and each binning keeps the position of its energies
+		if (_energies.empty()) {
+			for (const auto &ig : _global_true)
+				for (size_t i = 0; i < ig.second.size() - 1; ++i)
+					_energies.push_back((ig.second[i] + ig.second[i+1]) / 2.);
+			osc->SetEnergies(_energies);
+
+			for (const auto &ig : _global_true)
+				for (size_t i = 0; i < ig.second.size() - 1; ++i)
+					_energy_index[ig.first].push_back(osc->EnergyIndex
+						((ig.second[i] + ig.second[i+1]) / 2.));
+		}
+		else
+			osc->SetEnergies(_energies);
+	}
+
 	std::unordered_map<std::string, Eigen::VectorXd> samples;
 	for (const auto &ir : _reco) {
 
@@ -320,12 +337,11 @@ std::unordered_map<std::string, Eigen::VectorXd>
 				std::cout << "Oscillating spectrum for " << ir.first
 					  << " (" << hname << ") with "
 					  << nuIn << " -> " << nuOut << "\n";
-			const auto &bins = _global_true[hname]; //type?
-
-			for (size_t i = 0; i < bins.size() - 1; ++i) {
-				probs(i) = osc->Probability(nuIn, nuOut, //chan.first, chan.second,
-						(bins[i] + bins[i+1]) / 2.);
-			}
+			// probabilities of all channels are computed at once
+			// for all the precomputed energies
+			const auto &index = _energy_index[hname];
+			for (size_t i = 0; i < index.size(); ++i)
+				probs(i) = osc->ProbabilityAt(nuIn, index[i])(nuOut % 3, nuIn % 3);
 			//std::cout<< "Number of bins " << bins.size() <<std::endl;
 			//probs = osc->Oscillate(chan.first, chan.second, _global[ir.first]);
 		}
@@ -343,6 +359,54 @@ std::unordered_map<std::string, Eigen::VectorXd>
 	return samples;
 }
 
+// derivatives of the spectra of BuildSamples with respect to the oscillation
+// parameters, with one column per parameter, see Oscillator::ProbabilityGradient
+// NC channels do not depend on them
+std::unordered_map<std::string, Eigen::MatrixXd>
+	BeamSample::BuildJacobians(std::shared_ptr<Oscillator> osc)
+{
+	osc->SetMatterProfile(_lens_dens);
+
+	// derivatives at the bin centres, for each binning and sector
+	// as they are shared by all channels of the same sector
+	std::map<std::pair<std::string, int>,
+		std::vector<std::vector<Eigen::MatrixXd> > > grads;
+
+	std::unordered_map<std::string, Eigen::MatrixXd> jacobians;
+	for (const auto &ir : _reco) {
+		if (ir.first.find("NC") != std::string::npos)
+			continue;
+
+		std::string hname = ir.first;
+		size_t len = hname.find_last_of('_') - hname.find_first_of('_');
+		auto nuIn  = Nu::fromString(hname.substr(hname.find("_nu")+1, 4));
+		auto nuOut = Nu::fromString(hname.substr(hname.rfind("_nu")+1, 4));
+		hname.erase(hname.find_first_of('_'), len);
+
+		auto key = std::make_pair(hname, nuIn / 3);
+		if (!grads.count(key)) {
+			const auto &bins = _global_true[hname];
+			auto &gs = grads[key];
+			gs.resize(bins.size() - 1);
+			for (size_t i = 0; i < gs.size(); ++i)
+				osc->ProbabilityGradient(nuIn, (bins[i] + bins[i+1]) / 2., gs[i]);
+		}
+
+		const auto &gs = grads[key];
+		Eigen::MatrixXd dprobs(ir.second.cols(), 6);
+		for (int i = 0; i < dprobs.rows(); ++i)
+			for (int p = 0; p < dprobs.cols(); ++p)
+				dprobs(i, p) = gs[i][p](nuOut % 3, nuIn % 3);
+
+		if (jacobians.count(hname))
+			jacobians[hname] += ir.second * dprobs;
+		else
+			jacobians[hname] = ir.second * dprobs;
+	}
+
+	return jacobians;
+}
+
 
 
 /*
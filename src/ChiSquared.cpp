@@ -56,10 +56,18 @@ void ChiSquared::Init(const CardDealer &cd)
 
 	if (!cd.Get("verbose", kVerbosity))
 		kVerbosity = 0;
+
+	// if set, overrides the dCP harmonics option of each sample
+	if (!cd.Get("cp_harmonics", kHarmonics))
+		kHarmonics = -1;
 }
 
 bool ChiSquared::Combine()
 {
+	if (kHarmonics >= 0)
+		for (const auto &is : _sample)
+			is->SetHarmonics(kHarmonics);
+
 	CombineBinning();
 	CombineCorrelation();
 	//CombineSystematics();
@@ -67,6 +75,25 @@ bool ChiSquared::Combine()
 	return (_nBin >= 0 && _nSys >= 0);
 }
 
+bool ChiSquared::UseHarmonics() const
+{
+	for (const auto &is : _sample)
+		if (is->UseHarmonics())
+			return true;
+	return false;
+}
+
+// summed over the samples
+std::pair<size_t, size_t> ChiSquared::HarmonicsUsage() const
+{
+	std::pair<size_t, size_t> usage(0, 0);
+	for (const auto &is : _sample) {
+		usage.first += is->HarmonicsUsage().first;
+		usage.second += is->HarmonicsUsage().second;
+	}
+	return usage;
+}
+
 
 int ChiSquared::NumBin() {
 	if (_nBin < 0)
@@ -212,6 +239,18 @@ Eigen::VectorXd ChiSquared::ConstructSamples(std::shared_ptr<Oscillator> osc) {
 	return vect;
 }
 
+// derivatives of the spectra with respect to the oscillation parameters
+Eigen::MatrixXd ChiSquared::ConstructJacobian(std::shared_ptr<Oscillator> osc) {
+	Eigen::MatrixXd jac(_nBin, 6);
+	int bin_off = 0;
+	for (const auto &is : _sample) {
+		jac.middleRows(bin_off, is->_nBin) = is->ConstructJacobian(osc);
+		bin_off += is->_nBin;
+	}
+
+	return jac;
+}
+
 //On is the true spectrum, En is the observed spectrum
 //return time taken for computation
 Eigen::VectorXd ChiSquared::FitX2(const Eigen::VectorXd &On, const Eigen::VectorXd &En)
@@ -1,17 +1,33 @@
 #include "physics/Oscillator.h"
 
+// specialisations for 3 neutrinos of the kernel, defined below
+template <>
+Oscillator::StateVector<3> Oscillator::MatterStates<3>(double ff, int off) const;
+template <>
+Eigen::ArrayXXd Oscillator::BatchStates<3>(const Eigen::ArrayXd &ff, int off) const;
+template <>
+bool Oscillator::MirrorPhases<3>(Phases<3> &dd) const;
+
 Oscillator::Oscillator(const std::vector<double> &lengths,
 		       const std::vector<double> &densities,
 		       bool lut, double threshold) :
 	_dim(3),
 	_thr(threshold),
-	kLUT(lut)
+	kLUT(lut),
+	_profile(0),
+	_lut_size(1 << 17),
+	kFloat(false),
+	kChecked(false),
+	_float_tol(1e-4),
+	kTable(false),
+	kInvariants(false)
 {
-	_lens_dens.reserve(lengths.size());
+	Profile lens_dens;
+	lens_dens.reserve(lengths.size());
 	for (size_t i = 0; i < lengths.size(); ++i)
-		_lens_dens.push_back({lengths[i], densities[i], 0.5});
+		lens_dens.push_back({lengths[i], densities[i], 0.5});
 
-	//trans = Eigen::MatrixXcd::Identity(_dim, _dim);
+	SetMatterProfile(lens_dens);
 }
 
 Oscillator::Oscillator(const std::vector<double> &lengths,
@@ -20,37 +36,64 @@ Oscillator::Oscillator(const std::vector<double> &lengths,
 		       bool lut, double threshold) :
 	_dim(3),
 	_thr(threshold),
-	kLUT(lut)
+	kLUT(lut),
+	_profile(0),
+	_lut_size(1 << 17),
+	kFloat(false),
+	kChecked(false),
+	_float_tol(1e-4),
+	kTable(false),
+	kInvariants(false)
 {
-	_lens_dens.reserve(lengths.size());
+	Profile lens_dens;
+	lens_dens.reserve(lengths.size());
 	for (size_t i = 0; i < lengths.size(); ++i)
-		_lens_dens.push_back({lengths[i], densities[i], electrons[i]});
+		lens_dens.push_back({lengths[i], densities[i], electrons[i]});
 
-	//trans = Eigen::MatrixXcd::Identity(_dim, _dim);
+	SetMatterProfile(lens_dens);
 }
 
 Oscillator::Oscillator(const std::string &densityFile, 
 		       bool lut, double threshold) :
 	_dim(3),
 	_thr(threshold),
-	kLUT(lut)
+	kLUT(lut),
+	_profile(0),
+	_lut_size(1 << 17),
+	kFloat(false),
+	kChecked(false),
+	_float_tol(1e-4),
+	kTable(false),
+	kInvariants(false)
 {
 	SetMatterProfile(GetMatterProfile(densityFile));
 }
 
 
 Oscillator::Oscillator(const std::string &card)
+	: _profile(0),
+	kChecked(false),
+	kTable(false),
+	kInvariants(false)
 {
 	CardDealer cd(card);
 	FromCard(cd);
 }
 
 Oscillator::Oscillator(CardDealer *cd)
+	: _profile(0),
+	kChecked(false),
+	kTable(false),
+	kInvariants(false)
 {
 	FromCard(*cd);
 }
 
 Oscillator::Oscillator(const CardDealer &cd)
+	: _profile(0),
+	kChecked(false),
+	kTable(false),
+	kInvariants(false)
 {
 	FromCard(cd);
 }
@@ -60,10 +103,8 @@ void Oscillator::FromCard(const CardDealer &cd)
 	std::string densityFile;
 	if (cd.Get("density_profile", densityFile))
 		SetMatterProfile(GetMatterProfile(densityFile));
-	else {	//default  vacuum oscillation
-		_lens_dens.clear();
-		_lens_dens.push_back({295., 0, 0.5});
-	}
+	else	//default  vacuum oscillation
+		SetMatterProfile({{295., 0, 0.5}});
 
 	if (!cd.Get("neutrinos", _dim))
 		_dim = 3;		// default neutrinos
@@ -73,6 +114,19 @@ void Oscillator::FromCard(const CardDealer &cd)
 
 	if (!cd.Get("LUT", kLUT))	//look up table stores matrices
 		kLUT = false;
+
+	if (!cd.Get("float_kernel", kFloat))	//single precision batched kernel
+		kFloat = false;
+
+	if (!cd.Get("float_tolerance", _float_tol))	//max error of float kernel
+		_float_tol = 1e-4;
+
+	double memory;	// memory budget of LUT in MB
+	if (!cd.Get("LUT_memory", memory))
+		memory = 64;
+	// each entry has a N x N matrix, plus map and list nodes
+	_lut_size = std::max(1., memory * 1024 * 1024 / (sizeof(LUTEntry)
+			+ _dim * _dim * sizeof(double) + 128));
 }
 
 
@@ -110,15 +164,202 @@ Oscillator::Profile Oscillator::GetMatterProfile(const std::string &densityFile)
 	return lens_dens;
 }
 
+// the look up table of the previous profiles are kept
 void Oscillator::SetMatterProfile(const Oscillator::Profile &l_d)
 {
 	_lens_dens = l_d;
-	Reset();
+	SelectTable();
+}
+
+// hash of all the lengths, densities, and yields of the profile
+size_t Oscillator::Fingerprint(const Oscillator::Profile &ld)
+{
+	std::hash<double> hasher;
+	size_t seed = ld.size();
+	for (const auto &l : ld)
+		for (double x : l)
+			seed ^= hasher(x) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+	return seed;
 }
 
 //return oscillation probability from flavor in to flavor out at energy given
 //the lengths and densities are fixed beforehand
 double Oscillator::Probability(Nu::Flavor in, Nu::Flavor out, double energy, bool force)
+{
+	CheckFlavors(in, out, force);
+
+	// flat table is used only if it is up to date
+	int index = kTable && _tab_profile == _profile ? EnergyIndex(energy) : -1;
+	if (index >= 0)
+		return in / 3 == out / 3 ? ProbabilityAt(in, index)(out % 3, in % 3) : 0.;
+
+	// neutrinos and antineutrinos do not mix
+	if (in / 3 != out / 3)
+		return 0.;
+
+	if (!kLUT)
+		return std::norm(TransitionMatrix(in, energy)(out % 3, in % 3));
+
+	return LookUp(energy, in / 3)->second.prob(out % 3, in % 3);
+}
+
+//return oscillation probabilities from flavor in to flavor out for all
+//the energies given, which are propagated together in the same matter profile
+//the LUT is not used here
+Eigen::ArrayXd Oscillator::Probability(Nu::Flavor in, Nu::Flavor out,
+				const Eigen::ArrayXd &energies, bool force)
+{
+	CheckFlavors(in, out, force);
+
+	// neutrinos and antineutrinos do not mix
+	if (in / 3 != out / 3)
+		return Eigen::ArrayXd::Zero(energies.size());
+
+	// column of element (out, in) in the batched matrix
+	return ProbabilityMatrix(in, energies).col(out % 3 + _dim * (in % 3));
+}
+
+//return the probabilities between all the flavors of the same sector
+//(neutrino or antineutrino) of nu with just one propagation
+//element (out, in) is the probability from in to out, where flavors
+//are counted from the first of the sector, i.e. Nu::E_ and Nu::Eb are 0
+Eigen::MatrixXd Oscillator::ProbabilityMatrix(Nu::Flavor nu, double energy)
+{
+	// flat table is used only if it is up to date
+	int index = kTable && _tab_profile == _profile ? EnergyIndex(energy) : -1;
+	if (index >= 0)
+		return ProbabilityAt(nu, index);
+
+	if (!kLUT)
+		return TransitionMatrix(nu, energy).cwiseAbs2();
+
+	return LookUp(energy, nu / 3)->second.prob;
+}
+
+//batched version of the above, for all the energies given
+//column out + N in contains the probabilities from in to out
+Eigen::ArrayXXd Oscillator::ProbabilityMatrix(Nu::Flavor nu,
+				const Eigen::ArrayXd &energies)
+{
+	int sector = nu / 3;	// 0 is neutrino, 1 is antineutrino
+	Invariants();
+	if (kFloat && PrecisionCheck(energies))
+		return BatchProbability<float>(_lens_dens, energies, sector);
+	return BatchProbability<double>(_lens_dens, energies, sector);
+}
+
+//the single precision kernel is compared with the double precision one
+//on the first energies it is used with, in both sectors, and it is
+//turned off if the largest difference of probabilities is above tolerance
+//returns true if the single precision kernel can be used
+bool Oscillator::PrecisionCheck(const Eigen::ArrayXd &energies)
+{
+	if (kChecked)
+		return kFloat;
+	kChecked = true;
+
+	Invariants();
+	double diff = 0;
+	for (int sector = 0; sector < 2; ++sector) {
+		const Eigen::ArrayXXd single = BatchProbability<float>(_lens_dens, energies, sector);
+		const Eigen::ArrayXXd prob = BatchProbability<double>(_lens_dens, energies, sector);
+		diff = std::max(diff, (single - prob).abs().maxCoeff());
+	}
+
+	if (diff > _float_tol) {
+		std::cerr << "WARNING - Oscillator : single precision kernel has error "
+			  << diff << " above tolerance " << _float_tol << "\n"
+			  << "        falling back to double precision" << std::endl;
+		kFloat = false;
+	}
+
+	return kFloat;
+}
+
+//probabilities of the sector of nu, as ProbabilityMatrix, together with
+//their derivatives with respect to the oscillation parameters, which are
+//M12, M23, S12, S13, S23 (sines squared), and dCP, in this order
+//all of them are computed in the same pass over the layers
+Eigen::MatrixXd Oscillator::ProbabilityGradient(Nu::Flavor nu, double energy,
+				std::vector<Eigen::MatrixXd> &grad)
+{
+	int sector = nu / 3;	// 0 is neutrino, 1 is antineutrino
+	switch (_dim) {
+		case 3:
+		{
+			Invariants();
+			std::array<Sector<3>, 6> damp;
+			Sector<3> amp = PropagateGradient<3>(_lens_dens, energy, sector, damp);
+
+			// dP = 2 Re(A* dA) element by element
+			grad.resize(damp.size());
+			for (size_t p = 0; p < damp.size(); ++p)
+				grad[p] = 2 * (amp.conjugate().cwiseProduct(damp[p])).real();
+			return amp.cwiseAbs2();
+		}
+		default:
+			throw std::invalid_argument("Oscillator: derivatives with "
+					+ std::to_string(_dim) + " neutrinos are not implemented");
+	}
+}
+
+//const evaluation path, nothing in the oscillator is changed and the
+//matter profile is taken from the context of the calling thread
+//Prepare computes in advance everything that is otherwise computed on
+//demand, so it must be called after the parameters are set
+//the look up table is not used, but the flat table of precomputed
+//energies is, if it was filled for the same profile of the context
+//callers that never use the precomputed energies skip the table
+void Oscillator::Prepare(bool table)
+{
+	Invariants();
+	if (table && !_tab_energies.empty() && (!kTable || _tab_profile != _profile))
+		FillTable();
+}
+
+void Oscillator::CheckPrepared() const
+{
+	if (!kInvariants)
+		throw std::logic_error("Oscillator: Prepare must be called "
+				"before using the const methods");
+}
+
+double Oscillator::Probability(const Context &ctx, Nu::Flavor in, Nu::Flavor out,
+			       double energy) const
+{
+	// neutrinos and antineutrinos do not mix
+	if (in / 3 != out / 3)
+		return 0.;
+
+	return ProbabilityMatrix(ctx, in, energy)(out % 3, in % 3);
+}
+
+Eigen::MatrixXd Oscillator::ProbabilityMatrix(const Context &ctx, Nu::Flavor nu,
+					      double energy) const
+{
+	CheckPrepared();
+
+	int index = kTable && _tab_profile == ctx.fingerprint ? EnergyIndex(energy) : -1;
+	if (index >= 0)
+		return TableEntry(nu, index);
+
+	return Amplitude(ctx.profile, energy, nu / 3).cwiseAbs2();
+}
+
+// the single precision kernel is used only if it has already passed
+// the accuracy check, which is not done here
+Eigen::ArrayXXd Oscillator::ProbabilityMatrix(const Context &ctx, Nu::Flavor nu,
+					      const Eigen::ArrayXd &energies) const
+{
+	CheckPrepared();
+
+	int sector = nu / 3;	// 0 is neutrino, 1 is antineutrino
+	if (kFloat && kChecked)
+		return BatchProbability<float>(ctx.profile, energies, sector);
+	return BatchProbability<double>(ctx.profile, energies, sector);
+}
+
+void Oscillator::CheckFlavors(Nu::Flavor in, Nu::Flavor out, bool force)
 {
 	if (std::abs(in - out) >= 3 && !force)
 	{
@@ -128,28 +369,16 @@ double Oscillator::Probability(Nu::Flavor in, Nu::Flavor out, double energy, boo
 			  << "        to suppress this message"
 			  << std::endl;
 	}
-
-	if (!kLUT)
-		return TransitionMatrix(energy).cwiseAbs2()(out, in);
-
-	auto ilut = FindEnergy(energy);
-	if (ilut != mLUT.end())	{ // use precomputed matrix
-		return (ilut->second)(out, in);
-	}
-	else	// save new matrix
-	{
-		mLUT[energy] = TransitionMatrix(energy).cwiseAbs2();
-		return mLUT[energy](out, in);
-	}
 }
 
 /* deprecated! */
 Eigen::VectorXd Oscillator::Oscillate(Nu::Flavor in, Nu::Flavor out,
 				const std::vector<double> &bins)
 {
-	Eigen::VectorXd vb(bins.size() - 1);
-	for (int i = 0; i < vb.size(); ++i)
-		vb(i) = Probability(in, out, (bins[i+1] + bins[i]) / 2.);
+	Eigen::ArrayXd energies(bins.size() - 1);
+	for (int i = 0; i < energies.size(); ++i)
+		energies(i) = (bins[i+1] + bins[i]) / 2.;
+	Eigen::VectorXd vb = Probability(in, out, energies);
 	//Eigen::VectorXd vb(bins.size());
 	//for (int i = 0; i < vb.size(); ++i)
 	//	vb(i) = Probability(in, out, bins[i]);
@@ -195,160 +424,599 @@ double Oscillator::ElectronDensity() {
 void Oscillator::Reset()
 {
 	mLUT.clear();
+	_lru.clear();
+	SelectTable();
+	kTable = false;
+	kInvariants = false;
+}
+
+// parameter only quantities, which depend neither on energy nor density,
+// are computed once after masses or mixing change and reused by all layers
+void Oscillator::Invariants()
+{
+	if (kInvariants)
+		return;
+	kInvariants = true;
+
+	// |Ue_i|² for neutrinos and antineutrinos
+	_ues.resize(2, _dim);
+	for (int i = 0; i < _dim; ++i) {
+		_ues(0, i) = std::norm(_pmns(0, i));
+		_ues(1, i) = std::norm(_pmns(_dim, _dim + i));
+	}
+
+	// outer products of electron row, the matter term without density factor
+	const Eigen::RowVectorXcd ue  = _pmns.row(0);
+	const Eigen::RowVectorXcd ueb = _pmns.row(_dim);
+	_ue2 = ueb.adjoint() * ueb - ue.adjoint() * ue;
+
+	// vacuum hamiltonian U diag(m²) U^dagger of each sector
+	_ham = _pmns * dms.replicate(2, 1).asDiagonal() * _pmns.adjoint();
+
+	// the sorting of the matter solutions depends only on the vacuum ones
+	// so the permutation is the same for all energies and layers
+	Eigen::VectorXd vVac = MatterStates(0.0);
+	_order.resize(_dim);
+	std::iota(_order.begin(), _order.end(), 0);
+	for (int i = 0; i < _dim-1; ++i) {
+		int k = i;
+		double val = fabs(dms(i) - vVac(i));
+		for (int j = i+1; j < _dim; ++j) {
+			if (val > fabs(dms(i) - vVac(j)))
+			{
+				k = j;
+				val = fabs(dms(i) - vVac(j));
+			}
+		}
+		std::swap(_order[i], _order[k]);
+	}
+}
+
+// find or create the table of the current profile; if the previous
+// table is empty it is removed, so that profiles are not accumulated
+// when the LUT is not used
+void Oscillator::SelectTable()
+{
+	auto itab = mLUT.find(_profile);
+	if (itab != mLUT.end() && itab->second.lut[0].empty()
+			       && itab->second.lut[1].empty())
+		mLUT.erase(itab);
+
+	_profile = Fingerprint(_lens_dens);
+	itab = mLUT.find(_profile);
+	if (itab == mLUT.end()) {
+		mLUT[_profile].profile = _lens_dens;
+		return;
+	}
+
+	// two different profiles with same fingerprint, drop older one
+	if (itab->second.profile != _lens_dens) {
+		for (auto &lut : itab->second.lut) {
+			for (const auto &il : lut)
+				_lru.erase(il.second.use);
+			lut.clear();
+		}
+		itab->second.profile = _lens_dens;
+	}
 }
 
-std::map<double, Eigen::MatrixXd>::iterator Oscillator::FindEnergy(double energy)
+Oscillator::LUT::iterator Oscillator::FindEnergy(double energy, int sector)
 {
-	if (!mLUT.size())	// empty, just return end
-		return mLUT.end();
+	LUT &lut = mLUT[_profile].lut[sector];
+	if (!lut.size())	// empty, just return end
+		return lut.end();
 
-	auto ilut = mLUT.lower_bound(energy);
+	auto ilut = lut.lower_bound(energy);
 
 	// there is a lower bound, so check if it is pointing at the right element
-	if (ilut != mLUT.end() && std::abs(ilut->first - energy) < _thr)
+	if (ilut != lut.end() && std::abs(ilut->first - energy) < _thr)
 		return ilut;
 
-	// works even if ilut == mLUT.end(), check previous element which can be good 
-	if (ilut != mLUT.begin() && std::abs(std::prev(ilut)->first - energy) < _thr)
+	// works even if ilut == lut.end(), check previous element which can be good 
+	if (ilut != lut.begin() && std::abs(std::prev(ilut)->first - energy) < _thr)
 		return std::prev(ilut);
 
 	// nothing matches, so return end
-	return mLUT.end();
+	return lut.end();
+}
+
+// return the entry for this energy and profile, computing it if not found
+// and removing the least recently used entries above the memory budget
+Oscillator::LUT::iterator Oscillator::LookUp(double energy, int sector)
+{
+	LUT &lut = mLUT[_profile].lut[sector];
+	auto ilut = FindEnergy(energy, sector);
+	++_lut_calls;
+	if (ilut != lut.end()) {	// use precomputed matrix
+		_lru.splice(_lru.begin(), _lru, ilut->second.use);
+		++_lut_hits;
+		return ilut;
+	}
+
+	// save new matrix
+	_lru.push_front(LUTKey{_profile, sector, energy});
+	Eigen::MatrixXd prob = TransitionMatrix(Nu::Flavor(3 * sector), energy).cwiseAbs2();
+	ilut = lut.emplace(energy, LUTEntry{prob, _lru.begin()}).first;
+
+	while (_lru.size() > _lut_size) {
+		const LUTKey &key = _lru.back();
+		auto itab = mLUT.find(key.profile);
+		itab->second.lut[key.sector].erase(key.energy);
+		if (itab->second.lut[0].empty() && itab->second.lut[1].empty()
+		    && key.profile != _profile)
+			mLUT.erase(itab);
+		_lru.pop_back();
+	}
+
+	return ilut;
+}
+
+std::pair<size_t, size_t> Oscillator::LUTUsage() const
+{
+	return std::make_pair(_lut_calls, _lut_hits);
+}
+
+// energies are sorted and duplicates removed, nothing
+// is done if they are the same as the ones already set
+void Oscillator::SetEnergies(const std::vector<double> &energies)
+{
+	std::vector<double> sorted(energies);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+	if (sorted == _tab_energies)
+		return;
+
+	_tab_energies = std::move(sorted);
+	kTable = false;
+}
+
+// position of energy in the precomputed table, -1 if not there
+int Oscillator::EnergyIndex(double energy) const
+{
+	if (_tab_energies.empty())
+		return -1;
+
+	auto ie = std::lower_bound(_tab_energies.begin(), _tab_energies.end(), energy);
+	if (ie != _tab_energies.end() && std::abs(*ie - energy) < _thr)
+		return std::distance(_tab_energies.begin(), ie);
+	if (ie != _tab_energies.begin() && std::abs(*std::prev(ie) - energy) < _thr)
+		return std::distance(_tab_energies.begin(), ie) - 1;
+
+	return -1;
+}
+
+// matrix of the sector of nu at the index-th energy, as in ProbabilityMatrix
+// the table is recomputed if parameters or profile changed
+Eigen::Map<const Eigen::MatrixXd> Oscillator::ProbabilityAt(Nu::Flavor nu, int index)
+{
+	if (!kTable || _tab_profile != _profile)
+		FillTable();
+
+	return TableEntry(nu, index);
+}
+
+// matrix of the sector of nu at the energy index in the flat table
+Eigen::Map<const Eigen::MatrixXd> Oscillator::TableEntry(Nu::Flavor nu, int index) const
+{
+	const int nn = _dim * _dim;
+	return Eigen::Map<const Eigen::MatrixXd>(_table.data()
+			+ (2 * index + nu / 3) * nn, _dim, _dim);
+}
+
+// all energies are propagated at once with the batched kernel
+void Oscillator::FillTable()
+{
+	const int n = _tab_energies.size();
+	const int nn = _dim * _dim;
+	const Eigen::ArrayXd energies = Eigen::Map<const Eigen::ArrayXd>
+		(_tab_energies.data(), n);
+
+	_table.resize(2 * n * nn);
+	for (int sector = 0; sector < 2; ++sector) {
+		Eigen::ArrayXXd prob = ProbabilityMatrix(Nu::Flavor(3 * sector), energies);
+		for (int e = 0; e < n; ++e)
+			for (int c = 0; c < nn; ++c)
+				_table[(2 * e + sector) * nn + c] = prob(e, c);
+	}
+
+	_tab_profile = _profile;
+	kTable = true;
 }
 
 //*****************************************************************
 //	ENTERING THE WORLD OF PHYSICS AND BLACK MAGIC HERE
 //*****************************************************************
 //
+// The propagation is done by a kernel templated on the number N of
+// neutrino flavours: all intermediate objects have fixed size and
+// live on the stack, so nothing is allocated for each layer
+// Only one sector (0 for neutrinos, 1 for antineutrinos) is propagated
 //
 //This is equivalent to propagate(int) in BargerPropagator.cc
-Eigen::MatrixXcd Oscillator::TransitionMatrix(double energy)
+template <int N>
+Oscillator::Sector<N> Oscillator::Propagate(const Profile &lens_dens,
+					    double energy, int sector) const
 {
-	//trans.setIdentity();
-	Eigen::MatrixXcd trans = Eigen::MatrixXcd::Identity(2*_dim, 2*_dim);
+	// a single layer has a closed form, see ConstantDensity
+	if (lens_dens.size() == 1)
+		return ConstantDensity<N>(lens_dens.front(), energy, sector);
+
+	// without the cubic formula for the matter solutions, each layer
+	// is diagonalised in flavour basis, see ConstantDensity
+	if (N > 3) {
+		Sector<N> amp = Sector<N>::Identity();
+		for (const auto &ld : lens_dens)
+			amp *= ConstantDensity<N>(ld, energy, sector);
+		return amp;
+	}
+
+	// antineutrinos see the opposite matter potential
+	const double sign = sector ? -1. : 1.;
 
 	// looping through different layers and densities
-	//for (auto ld = _lens_dens.begin(); ld != _lens_dens.end(); ++ld)
 	const double fG = Const::GF * Const::Na * pow(Const::hBarC * 1e8, 3);
-	for (const auto &ld : _lens_dens)
-	{
+	auto layer = [&](const LDY &ld) {
 		//ld is an array[3] containing <length, density, electron fraction>
 		// compute some energy factors...
-		double ff  = -sqrt(8) * fG * energy * ld[1] * ld[2];
+		double ff  = -sign * sqrt(8) * fG * energy * ld[1] * ld[2];
 		double l2e = Const::L2E * ld[0] / energy;
 
-		trans *= TransitionMatrix(ff, l2e);
+		return LayerMatrix<N>(ff, l2e, sector);
+	};
+
+	Sector<N> trans = Sector<N>::Identity();
+
+	Phases<N> dd;
+	int first = MirrorStart(lens_dens);
+	if (first < 0 || !MirrorPhases<N>(dd)) {
+		for (const auto &ld : lens_dens)
+			trans *= layer(ld);
+	}
+	else {	// second half is not computed, see MirrorStart
+		int half = (lens_dens.size() - first) / 2;
+		for (int i = 0; i < first; ++i)
+			trans *= layer(lens_dens[i]);
+
+		Sector<N> mirror = Sector<N>::Identity();
+		for (int i = first; i < first + half; ++i)
+			mirror *= layer(lens_dens[i]);
+
+		const Eigen::Matrix<std::complex<double>, N, 1> ds
+			= dd.template segment<N>(sector * N);
+		trans *= mirror * layer(lens_dens[first + half]);
+		trans *= ds.asDiagonal() * mirror.transpose() * ds.conjugate().asDiagonal();
 	}
 
-	return _pmns * trans * _pmns.adjoint();
+	const Sector<N> pmns = _pmns.block(sector * N, sector * N, N, N);
+	return pmns * trans * pmns.adjoint();
 }
 
-//This is equivalent to getA in mosc.cc
-Eigen::MatrixXcd Oscillator::TransitionMatrix(double ff, double l2e)
+// a profile like x0, x_n, ..., x_2, x_1, x_2, ..., x_n, as the ones from
+// Atmosphere::MatterProfile, is symmetric after the first layer
+// return the first layer of the symmetric part, -1 if there is none
+int Oscillator::MirrorStart(const Oscillator::Profile &lens_dens)
 {
-	Eigen::MatrixXd dmMatVac(2*_dim, _dim),
-			dmMatAnt(2*_dim, _dim);
+	for (int first = 1; first >= 0; --first) {
+		int n = lens_dens.size() - first;
+		if (n < 3 || n % 2 == 0)
+			continue;
+
+		bool mirror = true;
+		for (int i = 0; i < n / 2 && mirror; ++i)
+			mirror = lens_dens[first + i] == lens_dens[lens_dens.size() - 1 - i];
+		if (mirror)
+			return first;
+	}
+
+	return -1;
+}
+
+// the matrix of the layers of a symmetric profile in reverse order is
+// related to the matrix of the layers in forward order Y by
+//	X_1 X_2 ... X_n = D (X_n ... X_2 X_1)^T D*
+// because in mass basis each layer matrix is Γ Z Γ^dagger with Z symmetric,
+// where U = R23 Γ R13 R12 Γ^dagger and Γ = diag(1, 1, e^iδ), so D = Γ²
+// for antineutrinos, Γ is replaced by Γ*
+// returns false if the phases are not known for N neutrinos
+template <int N>
+bool Oscillator::MirrorPhases(Phases<N> &) const
+{
+	return false;
+}
+
+template <>
+bool Oscillator::MirrorPhases<3>(Phases<3> &dd) const
+{
+	std::complex<double> d2(std::cos(2 * _cp), std::sin(2 * _cp));
+	dd << 1., 1., d2, 1., 1., std::conj(d2);
+	return true;
+}
+
+// amplitude for a constant density, computed directly in flavour basis
+// for one sector (0 for neutrinos and 1 for antineutrinos)
+// with H the hamiltonian and M_k its eigenvalues, it is exactly
+//	A = sum_k exp(-i M_k L/2E) prod_{j != k} (H - M_j) / (M_k - M_j)
+// and the products are expanded in powers of H, so that only N-2
+// matrix products are needed and there is no rotation from mass basis
+template <int N>
+Oscillator::Sector<N> Oscillator::ConstantDensity(const LDY &ld,
+						    double energy, int sector) const
+{
+	// antineutrinos see the opposite matter potential
+	const double sign = sector ? -1. : 1.;
+
+	const double fG = Const::GF * Const::Na * pow(Const::hBarC * 1e8, 3);
+	double ff  = -sign * sqrt(8) * fG * energy * ld[1] * ld[2];
+	double fn  = -sign * sqrt(8) * fG * energy * ld[1] * (1 - ld[2]) / 2.;
+	double l2e = Const::L2E * ld[0] / energy;
+
+	const Sector<N> ham = Hamiltonian<N>(ff, sector, fn);
+
+	// with a sterile neutrino the eigenvalues can be degenerate, e.g. when
+	// it is decoupled, and the sum below is singular, so the fixed size
+	// eigensolver is used and A = V exp(-i M L/2E) V^dagger
+	if (N > 3) {
+		Eigen::SelfAdjointEigenSolver<Sector<N> > solver(ham);
+		StateVector<N> phi = -(solver.eigenvalues().array() - dms(0)) * l2e;
+		Eigen::Matrix<std::complex<double>, N, 1> phase;
+		for (int k = 0; k < N; ++k)
+			phase(k) = std::complex<double>(std::cos(phi(k)), std::sin(phi(k)));
+
+		return solver.eigenvectors() * phase.asDiagonal()
+			* solver.eigenvectors().adjoint();
+	}
+
+	// no sorting needed, the sum is symmetric in the eigenvalues
+	const StateVector<N> mm = MatterStates<N>(ff, sector * N);
+
+	// weights of the powers of H
+	std::array<std::complex<double>, N> ww;
+	ww.fill(0.);
+	for (int k = 0; k < N; ++k) {
+		// coefficients of the polynomial prod_{j != k} (x - M_j) / (M_k - M_j)
+		std::array<double, N> coef;
+		coef.fill(0.);
+		coef[0] = 1.;
+
+		int deg = 0;
+		for (int j = 0; j < N; ++j) {
+			if (j == k)
+				continue;
+
+			double inv = 1. / (mm(k) - mm(j));
+			++deg;
+			for (int p = deg; p > 0; --p)
+				coef[p] = (coef[p-1] - mm(j) * coef[p]) * inv;
+			coef[0] *= -mm(j) * inv;
+		}
+
+		double phi = -(mm(k) - dms(0)) * l2e;
+		std::complex<double> phase(std::cos(phi), std::sin(phi));
+		for (int p = 0; p < N; ++p)
+			ww[p] += phase * coef[p];
+	}
+
+	Sector<N> amp = ww[1] * ham;
+	amp.diagonal().array() += ww[0];
+
+	Sector<N> hp = ham;
+	for (int p = 2; p < N; ++p) {
+		hp *= ham;
+		amp += ww[p] * hp;
+	}
 
-	Eigen::MatrixXcd Ue2 = ff * _pmns.row(_dim).adjoint() * _pmns.row(_dim)
- 			     - ff * _pmns.row(0).adjoint() * _pmns.row(0);
+	return amp;
+}
 
-	//load matter matrices
-	MatterMatrices(dmMatVac, dmMatAnt, ff);
+// hamiltonian in flavour basis (times 2E) of one sector,
+// U diag(m²) U^dagger plus the matter potential on the electron flavour
+// sterile flavours, after the first three, do not feel the neutral current
+// potential of the active ones, so they are shifted by the neutron factor fn
+template <int N>
+Oscillator::Sector<N> Oscillator::Hamiltonian(double ff, int sector, double fn) const
+{
+	const int off = sector * N;
+	Sector<N> ham = _ham.block(off, off, N, N);
+	ham(0, 0) -= ff;
+	for (int s = 3; s < N; ++s)
+		ham(s, s) -= fn;
 
-	std::vector<Eigen::MatrixXcd> vmat(_dim,
-				      Eigen::MatrixXcd::Identity(2*_dim, 2*_dim));
+	return ham;
+}
+
+// generic matter solutions, eigenvalues of the hamiltonian
+// with a fixed size solver, without neutral current potential
+template <int N>
+Oscillator::StateVector<N> Oscillator::MatterStates(double ff, int off) const
+{
+	Eigen::SelfAdjointEigenSolver<Sector<N> > solver(Hamiltonian<N>(ff, off / N),
+			Eigen::EigenvaluesOnly);
+	return solver.eigenvalues();
+}
 
-	Eigen::VectorXd mat_phi = -dmMatVac.row(0) * l2e;
-	Eigen::VectorXd ant_phi = -dmMatVac.row(_dim) * l2e;
-	for (int k = 0; k < _dim; ++k) {
-		vmat[k].topLeftCorner(_dim, _dim) *= std::complex<double>
-				(std::cos(mat_phi(k)), std::sin(mat_phi(k)));
-		vmat[k].bottomRightCorner(_dim, _dim) *= std::complex<double>
-				(std::cos(ant_phi(k)), std::sin(ant_phi(k)));
+//This is equivalent to getA in mosc.cc, for one sector
+//the density factor ff has already the sign of the sector
+template <int N>
+Oscillator::Sector<N> Oscillator::LayerMatrix(double ff, double l2e, int sector) const
+{
+	const double sign = sector ? -1. : 1.;
+	const Sector<N> Ue2 = (sign * ff) * _ue2.block(sector * N, sector * N, N, N);
+
+	//matter solutions
+	const StateVector<N> mm = SortedStates<N>(ff, sector);
+	const StateVector<N> ms = dms;
+
+	std::array<Sector<N>, N> vmat;
+	for (int k = 0; k < N; ++k) {
+		double phi = -(mm(k) - ms(0)) * l2e;
+		vmat[k] = std::complex<double>(std::cos(phi), std::sin(phi))
+			* Sector<N>::Identity();
 	}
 
-	for (int j = 0; j < _dim; ++j) {
+	for (int j = 0; j < N; ++j) {
 		//this is (2EH-M / dM²)_j
-		Eigen::MatrixXcd eh = Ue2;
-		eh.diagonal() -= dmMatVac.col(j);
+		Sector<N> eh = Ue2;
+		eh.diagonal() += (ms.array() - mm(j)).matrix();
 
-		for (int k = 0; k < _dim; ++k) {
+		for (int k = 0; k < N; ++k) {
 			if (k == j)
 				continue;
-			vmat[k] *= eh * (dmMatAnt.col(j) - dmMatAnt.col(k))
-					.cwiseInverse().asDiagonal();
+			vmat[k] *= eh / (mm(k) - mm(j));
 		}
 	}
 
-	Eigen::MatrixXcd result = Eigen::MatrixXcd::Zero(2*_dim, 2*_dim);
-	return std::accumulate(vmat.begin(), vmat.end(), result);
+	Sector<N> result = Sector<N>::Zero();
+	for (int k = 0; k < N; ++k)
+		result += vmat[k];
+
+	return result;
 }
 
-//This is equialent to getM in mosc.cc
-// The strategy to sort out the three roots is to compute the vacuum
-// mass the same way as the "matter" masses are computed then these are sorted
-// according to the vaccum solutions
-void Oscillator::MatterMatrices(Eigen::MatrixXd &dmMatVac, //output - mass diff matter-vacuum
-				Eigen::MatrixXd &dmMatAnt, //output - mass diff matter
-				double ff)		//density factor
+// amplitude of one sector and its derivatives damp with respect to the
+// oscillation parameters, see ProbabilityGradient
+// in flavour basis a layer is S = sum_k e_k P_k, with e_k = exp(-i M_k L/2E)
+// and P_k the projectors on the eigenvectors of the hamiltonian H, so that
+// the derivative of the layer, for a change dH, is
+//	dS = sum_{a,b} F_ab P_a dH P_b
+// with F_ab = (e_a - e_b) / (M_a - M_b) and F_aa = -i L/2E e_a
+// and the product of the layers is differentiated with the chain rule
+// the symmetry of mirrored profiles is not exploited here
+template <int N>
+Oscillator::Sector<N> Oscillator::PropagateGradient(const Profile &lens_dens,
+		double energy, int sector, std::array<Sector<N>, 6> &damp) const
 {
-	Eigen::VectorXd vVac = MatterStates(0.0);	//vacuum solutions
+	// antineutrinos see the opposite matter potential
+	const double sign = sector ? -1. : 1.;
+	const int off = sector * N;
+
+	// derivatives of the vacuum hamiltonian U diag(m²) U^dagger,
+	// the matter potential does not depend on the parameters
+	const Sector<N> pmns = _pmns.block(off, off, N, N);
+	const StateVector<N> ms = dms;
+	std::array<Sector<N>, 6> dham;
+	for (int p = 0; p < 2; ++p) {
+		const StateVector<N> dm = _ddms.col(p);
+		dham[p] = pmns * dm.asDiagonal() * pmns.adjoint();
+	}
+	for (int p = 0; p < 4; ++p) {
+		const Sector<N> du = sector ? _dpmns[p].conjugate() : _dpmns[p];
+		const Sector<N> dh = du * ms.asDiagonal() * pmns.adjoint();
+		dham[2 + p] = dh + dh.adjoint();
+	}
 
-	Eigen::VectorXd vMat = MatterStates( ff);	//matter solutions
-	Eigen::VectorXd vAnt = MatterStates(-ff, _dim);//antimatter solutions
+	Sector<N> amp = Sector<N>::Identity();
+	for (auto &da : damp)
+		da.setZero();
 
-	////std::cout << "vVac\n" << vVac << std::endl << std::endl;
-	//std::cout << "vMat\n" << vMat << std::endl << std::endl;
-	//sorting according to which matter solution is closest to the respective vacuum sol.
-	//
-	for (int i = 0; i < _dim-1; ++i) {
-		int k = i;
-		double val = fabs(dms(i, 0) - vVac(i));
-		for (int j = i+1; j < _dim; ++j) {
-			if (val > fabs(dms(i, 0) - vVac(j)))
-			{
-				k = j;
-				val = fabs(dms(i, 0) - vVac(j));
+	const double fG = Const::GF * Const::Na * pow(Const::hBarC * 1e8, 3);
+	for (const auto &ld : lens_dens) {
+		double ff  = -sign * sqrt(8) * fG * energy * ld[1] * ld[2];
+		double l2e = Const::L2E * ld[0] / energy;
+
+		const Sector<N> ham = Hamiltonian<N>(ff, sector);
+		const StateVector<N> mm = MatterStates<N>(ff, off);
+
+		std::array<Sector<N>, N> proj;
+		Eigen::Matrix<std::complex<double>, N, 1> ee;
+		Sector<N> layer = Sector<N>::Zero();
+		for (int k = 0; k < N; ++k) {
+			proj[k] = Sector<N>::Identity();
+			for (int j = 0; j < N; ++j) {
+				if (j == k)
+					continue;
+				Sector<N> hm = ham;
+				hm.diagonal().array() -= mm(j);
+				proj[k] *= hm / (mm(k) - mm(j));
+			}
+
+			double phi = -(mm(k) - dms(0)) * l2e;
+			ee(k) = std::complex<double>(std::cos(phi), std::sin(phi));
+			layer += ee(k) * proj[k];
+		}
+
+		Sector<N> ff_ab;
+		for (int a = 0; a < N; ++a)
+			for (int b = 0; b < N; ++b)
+				ff_ab(a, b) = a == b ? std::complex<double>(0, -l2e) * ee(a)
+					: (ee(a) - ee(b)) / (mm(a) - mm(b));
+
+		for (size_t p = 0; p < damp.size(); ++p) {
+			Sector<N> dlayer = Sector<N>::Zero();
+			for (int a = 0; a < N; ++a) {
+				const Sector<N> pd = proj[a] * dham[p];
+				for (int b = 0; b < N; ++b)
+					dlayer += ff_ab(a, b) * pd * proj[b];
 			}
+			damp[p] = damp[p] * layer + amp * dlayer;
 		}
-		std::swap(vMat(i), vMat(k));
-		std::swap(vAnt(i), vAnt(k));
+		amp *= layer;
 	}
 
+	return amp;
+}
+
+// matter solutions of one sector, sorted according to the vacuum ones
+// the permutation is found in Invariants
+template <int N>
+Oscillator::StateVector<N> Oscillator::SortedStates(double ff, int sector) const
+{
+	const StateVector<N> states = MatterStates<N>(ff, sector * N);
+
+	StateVector<N> sorted;
+	for (int i = 0; i < N; ++i)
+		sorted(i) = states(_order[i]);
+
+	return sorted;
+}
+
+//This is equialent to getM in mosc.cc
+// The strategy to sort out the three roots is to compute the vacuum
+// mass the same way as the "matter" masses are computed then these are sorted
+// according to the vaccum solutions
+template <int N>
+void Oscillator::MatterMatrices(MassMatrix<N> &dmMatVac, //output - mass diff matter-vacuum
+				MassMatrix<N> &dmMatAnt, //output - mass diff matter
+				double ff) const	//density factor
+{
+	//sorting according to which matter solution is closest to the respective vacuum sol.
+	const StateVector<N> vMat = SortedStates<N>( ff, 0);	//matter solutions
+	const StateVector<N> vAnt = SortedStates<N>(-ff, 1);	//antimatter solutions
+
 	//matrix made ouf of vector Mat
-	dmMatAnt << vMat.transpose(), vMat.transpose(), vMat.transpose(),
-		    vAnt.transpose(), vAnt.transpose(), vAnt.transpose();
 	//	M1²	M2²	M3²	->  -  1-0 2-0
 	//	M1²	M2²	M3²	-> 0-1  -  2-1
 	//	M1²	M2²	M3²	-> 0-2 1-2  -
-	
 	//matrix made ouf of vector vacuum mass differences
-	dmMatVac << dms, dms, dms,	//	m1²-m1²,m1²-m1²,m1²-m1²
-		    dms, dms, dms;	//	m2²-m1²,m2²-m1²,m2²-m1²
-					//	m3²-m1²,m3²-m1²,m3²-m1²
+	//	m1²-m1²,m1²-m1²,m1²-m1²
+	//	m2²-m1²,m2²-m1²,m2²-m1²
+	//	m3²-m1²,m3²-m1²,m3²-m1²
+	const StateVector<N> ms = dms;
+	for (int i = 0; i < N; ++i) {
+		dmMatAnt.row(i)     = vMat.transpose();
+		dmMatAnt.row(N + i) = vAnt.transpose();
+		dmMatVac.col(i).template head<N>() = ms;
+		dmMatVac.col(i).template tail<N>() = ms;
+	}
 
 	dmMatVac = dmMatAnt - dmMatVac;
-	//Eigen::MatrixXd dmma = dmMatAnt;
-	//for (int i = 0; i < _dim; ++i)
-	//	dmMatAnt.col(i) -= dmma.col((i + 1) % _dim);
-
-	//std::cout << "newMat\n" << dmMatAnt.topLeftCorner(_dim, _dim) << "\n" << std::endl;
-	//std::cout << "newVac\n" << dmMatVac.topLeftCorner(_dim, _dim) << "\n" << std::endl;
 }
 
 // compute the matter mass squared vector, solution of Eq. 21/22 if PRD 22.11 (1980)
 // the input vacuum mass squared vector is defined as (m1², m2²-m1², m3²-m1²)
 //works only with 3 neutrino states
-Eigen::VectorXd Oscillator::MatterStates(double ff, int off)	//density factor	
+template <>
+Oscillator::StateVector<3> Oscillator::MatterStates<3>(double ff, int off) const	//density factor
 {
 	//pmns and massSquare are global
 	double ms1   =  dms(0);	//mass squared
 	double dms12 = -dms(1);	//delta m squared
 	double dms13 = -dms(2);	//delta m squared
 
-	double Ue1s = std::norm(_pmns(off, 0 + off));	//Ue1 squared
-	double Ue2s = std::norm(_pmns(off, 1 + off));	//Ue2 squared
-	double Ue3s = std::norm(_pmns(off, 2 + off));	//Ue3 squared
+	int sector = off / 3;
+	double Ue1s = _ues(sector, 0);	//Ue1 squared
+	double Ue2s = _ues(sector, 1);	//Ue2 squared
+	double Ue3s = _ues(sector, 2);	//Ue3 squared
 
 	double alpha = ff + dms12 + dms13; 
 	double beta = dms12 * dms13 + ff * (dms12 * (1 - Ue2s)
@@ -366,7 +1034,7 @@ Eigen::VectorXd Oscillator::MatterStates(double ff, int off)	//density factor
 	//double r2 = r0 + 2.0/3.0 * Const::pi;
 	double ang = std::acos(argo) / 3.;
 
-	Eigen::VectorXd vMat(_dim);
+	StateVector<3> vMat;
 	vMat(0) = - 2.0/3.0 * sqrt(pow(alpha, 2) - 3 * beta)
 		* std::cos(ang) + ms1 - alpha/3.0;
 	vMat(1) = - 2.0/3.0 * sqrt(pow(alpha, 2) - 3 * beta)
@@ -377,6 +1045,370 @@ Eigen::VectorXd Oscillator::MatterStates(double ff, int off)	//density factor
 	return vMat;
 }
 
+// batched version of the kernel for a single sector (0 for neutrinos and
+// 1 for antineutrinos) which propagates all the energies layer by layer
+// the returned amplitudes are U X U^dagger, one row per energy
+// the matrices are of type T, float or double, whereas the matter solutions
+// and the phases are always computed in double precision, because the
+// cubic roots are found from cancelling terms and the phases can be large
+template <int N, typename T>
+Oscillator::BatchMatrix<N, T> Oscillator::BatchPropagate(const Profile &lens_dens,
+		const Eigen::ArrayXd &energies, int sector) const
+{
+	// without the cubic formula, energies are propagated one by one
+	if (N > 3) {
+		BatchMatrix<N, T> amp(energies.size(), N*N);
+		for (int e = 0; e < energies.size(); ++e) {
+			const Sector<N> trans = Propagate<N>(lens_dens, energies(e), sector);
+			for (int c = 0; c < N*N; ++c)
+				amp(e, c) = trans.data()[c];
+		}
+		return amp;
+	}
+
+	// a single layer has a closed form, see ConstantDensity
+	if (lens_dens.size() == 1)
+		return BatchConstantDensity<N>(lens_dens.front(), energies, sector)
+			.template cast<std::complex<T> >();
+
+	const int n = energies.size();
+	const int off = sector * N;
+	// antineutrinos see the opposite matter potential
+	const double sign = sector ? -1. : 1.;
+
+	const Eigen::Matrix<std::complex<T>, N, N> pmns = _pmns.block(off, off, N, N)
+		.template cast<std::complex<T> >();
+	const StateVector<N> ms = dms;
+	// matter term, with the opposite sign of the potential for antineutrinos
+	const Sector<N> ue2 = sign * _ue2.block(off, off, N, N);
+
+	BatchMatrix<N, T> trans = BatchMatrix<N, T>::Zero(n, N*N);
+	for (int i = 0; i < N; ++i)
+		trans.col(i + N * i).setOnes();
+
+	BatchMatrix<N, T> layer(n, N*N), prod(n, N*N), eh(n, N*N), tmp(n, N*N);
+	Eigen::ArrayXXd mm(n, N);
+	Eigen::ArrayXd ff(n), l2e(n), phi(n), inv(n);
+	Eigen::Array<std::complex<T>, Eigen::Dynamic, 1> phase(n);
+	Eigen::Array<T, Eigen::Dynamic, 1> ffinv(n);
+
+	// compute the matrix of one layer in layer
+	const double fG = Const::GF * Const::Na * pow(Const::hBarC * 1e8, 3);
+	auto compute = [&](const LDY &ld)
+	{
+		ff  = (-sign * sqrt(8) * fG * ld[1] * ld[2]) * energies;
+		l2e = Const::L2E * ld[0] * energies.inverse();
+
+		const Eigen::ArrayXXd states = BatchStates<N>(ff, off);
+		for (int i = 0; i < N; ++i)
+			mm.col(i) = states.col(_order[i]);
+
+		layer.setZero();
+		for (int k = 0; k < N; ++k) {
+			phi = -(mm.col(k) - ms(0)) * l2e;
+			phase.real() = phi.cos().template cast<T>();
+			phase.imag() = phi.sin().template cast<T>();
+
+			bool first = true;
+			for (int j = 0; j < N; ++j) {
+				if (j == k)
+					continue;
+
+				//this is (2EH-M / dM²)_j
+				inv = (mm.col(k) - mm.col(j)).inverse();
+				ffinv = (ff * inv).template cast<T>();
+				for (int c = 0; c < N; ++c)
+					for (int r = 0; r < N; ++r) {
+						if (r == c)	// cancelling terms, in double precision
+							eh.col(r + N * c) = ((ue2(r, c).real() * ff
+								- (mm.col(j) - ms(r))) * inv).template cast<T>();
+						else
+							eh.col(r + N * c) = std::complex<T>(ue2(r, c)) * ffinv;
+					}
+
+				if (first)
+					prod.swap(eh);
+				else {
+					BatchProduct<N>(prod, eh, tmp);
+					prod.swap(tmp);
+				}
+				first = false;
+			}
+
+			for (int e = 0; e < N*N; ++e)
+				layer.col(e) += phase * prod.col(e);
+		}
+	};
+
+	// lhs = lhs * layer
+	auto multiply = [&](BatchMatrix<N, T> &lhs)
+	{
+		BatchProduct<N>(lhs, layer, tmp);
+		lhs.swap(tmp);
+	};
+
+	Phases<N> dd;
+	int first = MirrorStart(lens_dens);
+	if (first < 0 || !MirrorPhases<N>(dd)) {
+		for (const auto &ld : lens_dens) {
+			compute(ld);
+			multiply(trans);
+		}
+	}
+	else {	// second half is not computed, see MirrorStart
+		int half = (lens_dens.size() - first) / 2;
+		for (int i = 0; i < first; ++i) {
+			compute(lens_dens[i]);
+			multiply(trans);
+		}
+
+		BatchMatrix<N, T> mirror = BatchMatrix<N, T>::Zero(n, N*N);
+		for (int i = 0; i < N; ++i)
+			mirror.col(i + N * i).setOnes();
+		for (int i = first; i < first + half; ++i) {
+			compute(lens_dens[i]);
+			multiply(mirror);
+		}
+
+		BatchProduct<N>(trans, mirror, tmp);
+		trans.swap(tmp);
+		compute(lens_dens[first + half]);
+		multiply(trans);
+
+		// D mirror^T D*
+		for (int j = 0; j < N; ++j)
+			for (int i = 0; i < N; ++i)
+				layer.col(i + N * j) = std::complex<T>(dd(off + i) * std::conj(dd(off + j)))
+						     * mirror.col(j + N * i);
+		multiply(trans);
+	}
+
+	// rotate back to flavour basis
+	for (int j = 0; j < N; ++j)
+		for (int i = 0; i < N; ++i) {
+			tmp.col(i + N * j) = pmns(i, 0) * trans.col(N * j);
+			for (int a = 1; a < N; ++a)
+				tmp.col(i + N * j) += pmns(i, a) * trans.col(a + N * j);
+		}
+	for (int j = 0; j < N; ++j)
+		for (int i = 0; i < N; ++i) {
+			trans.col(i + N * j) = std::conj(pmns(j, 0)) * tmp.col(i);
+			for (int b = 1; b < N; ++b)
+				trans.col(i + N * j) += std::conj(pmns(j, b)) * tmp.col(i + N * b);
+		}
+
+	return trans;
+}
+
+// batched version of ConstantDensity, one row per energy
+template <int N>
+Oscillator::BatchMatrix<N> Oscillator::BatchConstantDensity(const LDY &ld,
+		const Eigen::ArrayXd &energies, int sector) const
+{
+	const int n = energies.size();
+	// antineutrinos see the opposite matter potential
+	const double sign = sector ? -1. : 1.;
+
+	const double fG = Const::GF * Const::Na * pow(Const::hBarC * 1e8, 3);
+	const Eigen::ArrayXd ff  = (-sign * sqrt(8) * fG * ld[1] * ld[2]) * energies;
+	const Eigen::ArrayXd l2e = Const::L2E * ld[0] * energies.inverse();
+
+	const Eigen::ArrayXXd mm = BatchStates<N>(ff, sector * N);
+
+	// weights of the powers of H
+	std::array<Eigen::ArrayXcd, N> ww;
+	for (int p = 0; p < N; ++p)
+		ww[p] = Eigen::ArrayXcd::Zero(n);
+
+	Eigen::ArrayXXd coef(n, N);
+	Eigen::ArrayXd inv(n), phi(n);
+	Eigen::ArrayXcd phase(n);
+	for (int k = 0; k < N; ++k) {
+		coef.setZero();
+		coef.col(0).setOnes();
+
+		int deg = 0;
+		for (int j = 0; j < N; ++j) {
+			if (j == k)
+				continue;
+
+			inv = (mm.col(k) - mm.col(j)).inverse();
+			++deg;
+			for (int p = deg; p > 0; --p)
+				coef.col(p) = (coef.col(p-1) - mm.col(j) * coef.col(p)) * inv;
+			coef.col(0) *= -mm.col(j) * inv;
+		}
+
+		phi = -(mm.col(k) - dms(0)) * l2e;
+		phase.real() = phi.cos();
+		phase.imag() = phi.sin();
+		for (int p = 0; p < N; ++p)
+			ww[p] += phase * coef.col(p);
+	}
+
+	// vacuum hamiltonian, the matter term changes only the ee element
+	const Sector<N> h0 = Hamiltonian<N>(0., sector);
+	BatchMatrix<N> ham(n, N*N);
+	for (int e = 0; e < N*N; ++e)
+		ham.col(e).setConstant(h0.data()[e]);
+	ham.col(0) -= ff;
+
+	BatchMatrix<N> amp(n, N*N);
+	for (int e = 0; e < N*N; ++e)
+		amp.col(e) = ww[1] * ham.col(e);
+	for (int i = 0; i < N; ++i)
+		amp.col(i + N * i) += ww[0];
+
+	BatchMatrix<N> hp = ham, tmp(n, N*N);
+	for (int p = 2; p < N; ++p) {
+		BatchProduct<N>(hp, ham, tmp);
+		hp.swap(tmp);
+		for (int e = 0; e < N*N; ++e)
+			amp.col(e) += ww[p] * hp.col(e);
+	}
+
+	return amp;
+}
+
+// product C = A B for each energy of the batch, C cannot be A or B
+template <int N, typename T>
+void Oscillator::BatchProduct(const BatchMatrix<N, T> &A, const BatchMatrix<N, T> &B,
+			      BatchMatrix<N, T> &C)
+{
+	for (int j = 0; j < N; ++j)
+		for (int i = 0; i < N; ++i) {
+			C.col(i + N * j) = A.col(i) * B.col(N * j);
+			for (int c = 1; c < N; ++c)
+				C.col(i + N * j) += A.col(i + N * c) * B.col(c + N * j);
+		}
+}
+
+// batched version of MatterStates, one row per density factor
+template <int N>
+Eigen::ArrayXXd Oscillator::BatchStates(const Eigen::ArrayXd &ff, int off) const
+{
+	Eigen::ArrayXXd vMat(ff.size(), N);
+	for (int i = 0; i < ff.size(); ++i)
+		vMat.row(i) = MatterStates<N>(ff(i), off).transpose().array();
+
+	return vMat;
+}
+
+template <>
+Eigen::ArrayXXd Oscillator::BatchStates<3>(const Eigen::ArrayXd &ff, int off) const
+{
+	double ms1   =  dms(0);	//mass squared
+	double dms12 = -dms(1);	//delta m squared
+	double dms13 = -dms(2);	//delta m squared
+
+	int sector = off / 3;
+	double Ue1s = _ues(sector, 0);	//Ue1 squared
+	double Ue2s = _ues(sector, 1);	//Ue2 squared
+	double Ue3s = _ues(sector, 2);	//Ue3 squared
+
+	const Eigen::ArrayXd alpha = ff + dms12 + dms13;
+	const Eigen::ArrayXd beta = dms12 * dms13 + ff * (dms12 * (1 - Ue2s)
+			+ dms13 * (1 - Ue3s) );
+	const Eigen::ArrayXd gamma = ff * dms12 * dms13 * Ue1s;
+
+	const Eigen::ArrayXd root = (alpha.square() - 3 * beta).sqrt();
+	const Eigen::ArrayXd argo = ((alpha * (2 * alpha.square() - 9 * beta) + 27 * gamma)
+		/ root.cube() / 2.0).max(-1.0).min(1.0);
+
+	const Eigen::ArrayXd ang = argo.acos() / 3.;
+
+	Eigen::ArrayXXd vMat(ff.size(), 3);
+	vMat.col(0) = - 2.0/3.0 * root * ang.cos() + ms1 - alpha/3.0;
+	vMat.col(1) = - 2.0/3.0 * root * (ang - 2./3. * Const::pi).cos() + ms1 - alpha/3.0;
+	vMat.col(2) = - 2.0/3.0 * root * (ang + 2./3. * Const::pi).cos() + ms1 - alpha/3.0;
+
+	return vMat;
+}
+
+// dynamic size interface, dispatching to the kernel with the
+// right number of neutrino flavours
+Eigen::MatrixXcd Oscillator::Amplitude(const Profile &lens_dens,
+				       double energy, int sector) const
+{
+	switch (_dim) {
+		case 3:
+			return Propagate<3>(lens_dens, energy, sector);
+		case 4:
+			return Propagate<4>(lens_dens, energy, sector);
+		default:
+			throw std::invalid_argument("Oscillator: propagation with "
+					+ std::to_string(_dim) + " neutrinos is not implemented");
+	}
+}
+
+template <typename T>
+Eigen::ArrayXXd Oscillator::BatchProbability(const Profile &lens_dens,
+		const Eigen::ArrayXd &energies, int sector) const
+{
+	switch (_dim) {
+		case 3:
+			return BatchPropagate<3, T>(lens_dens, energies, sector)
+				.abs2().template cast<double>();
+		case 4:
+			return BatchPropagate<4, T>(lens_dens, energies, sector)
+				.abs2().template cast<double>();
+		default:
+			throw std::invalid_argument("Oscillator: propagation with "
+					+ std::to_string(_dim) + " neutrinos is not implemented");
+	}
+}
+
+Eigen::MatrixXcd Oscillator::TransitionMatrix(Nu::Flavor nu, double energy)
+{
+	Invariants();
+	return Amplitude(_lens_dens, energy, nu / 3);
+}
+
+// both sectors, in the 2N x 2N block form of _pmns
+Eigen::MatrixXcd Oscillator::TransitionMatrix(double energy)
+{
+	Eigen::MatrixXcd trans = Eigen::MatrixXcd::Zero(2 * _dim, 2 * _dim);
+	trans.topLeftCorner(_dim, _dim) = TransitionMatrix(Nu::E_, energy);
+	trans.bottomRightCorner(_dim, _dim) = TransitionMatrix(Nu::Eb, energy);
+	return trans;
+}
+
+// the following are equivalent to the kernel methods above,
+// but they only work with 3 neutrino states
+Eigen::MatrixXcd Oscillator::TransitionMatrix(double ff, double l2e)
+{
+	Invariants();
+	Eigen::MatrixXcd trans = Eigen::MatrixXcd::Zero(6, 6);
+	trans.topLeftCorner(3, 3) = LayerMatrix<3>( ff, l2e, 0);
+	trans.bottomRightCorner(3, 3) = LayerMatrix<3>(-ff, l2e, 1);
+	return trans;
+}
+
+void Oscillator::MatterMatrices(Eigen::MatrixXd &dmMatVac,
+				Eigen::MatrixXd &dmMatAnt,
+				double ff)
+{
+	Invariants();
+	MassMatrix<3> vac, ant;
+	MatterMatrices<3>(vac, ant, ff);
+	dmMatVac = vac;
+	dmMatAnt = ant;
+}
+
+Eigen::VectorXd Oscillator::MatterStates(double ff, int off)
+{
+	Invariants();
+	switch (_dim) {
+		case 3:
+			return MatterStates<3>(ff, off);
+		case 4:
+			return MatterStates<4>(ff, off);
+		default:
+			throw std::invalid_argument("Oscillator: propagation with "
+					+ std::to_string(_dim) + " neutrinos is not implemented");
+	}
+}
+
 void Oscillator::AutoSet(const CardDealer &cd) {
 
 	double M12, M23, S12, S13, S23, dCP;
@@ -397,6 +1429,19 @@ void Oscillator::AutoSet(const CardDealer &cd) {
 	if (!cd.Get("mass_hierarchy", mh))
 		mh = "normal";
 
+	if (_dim > 3) {	// sterile neutrino
+		double M41, S14, S24, S34;
+		if (!cd.Get("M41", M41))
+			M41 = 0;
+		if (!cd.Get("S14", S14))
+			S14 = 0;
+		if (!cd.Get("S24", S24))
+			S24 = 0;
+		if (!cd.Get("S34", S34))
+			S34 = 0;
+		SetSterile(M41, S14, S24, S34);
+	}
+
 	if (mh == "normal")
 		SetMasses<Oscillator::normal>(M12, M23);
 	else if (mh == "inverted")
@@ -408,18 +1453,53 @@ void Oscillator::AutoSet(const CardDealer &cd) {
 void Oscillator::SetMasses_NH(double dms21, double dms23)
 {
 	dms = Eigen::VectorXd::Zero(_dim);
-	dms << 0, dms21, dms21+dms23;
+	dms.head(3) << 0, dms21, dms21+dms23;
+	if (_dim > 3)	// sterile mass, see SetSterile
+		dms(3) = _sterile[0];
+
+	// derivatives of the masses with respect to the two parameters
+	_ddms = Eigen::MatrixXd::Zero(_dim, 2);
+	_ddms.col(0).head(3) << 0, 1, 1;
+	_ddms.col(1).head(3) << 0, 0, 1;
 }
 
 void Oscillator::SetMasses_IH(double dms21, double dms23)
 {
 	SetMasses_NH(dms21, -dms23-dms21);
+
+	_ddms.col(0).head(3) << 0, 1, 0;
+	_ddms.col(1).head(3) << 0, 0, -1;
 }
 
 void Oscillator::SetMasses_abs(double ms2, double ms3)
 {
 	dms = Eigen::VectorXd::Zero(_dim);
-	dms << 0, ms2, ms3;
+	dms.head(3) << 0, ms2, ms3;
+	if (_dim > 3)	// sterile mass, see SetSterile
+		dms(3) = _sterile[0];
+
+	_ddms = Eigen::MatrixXd::Zero(_dim, 2);
+	_ddms.col(0).head(3) << 0, 1, 0;
+	_ddms.col(1).head(3) << 0, 0, 1;
+}
+
+// mass splitting dm41 and sines squared of the mixing angles of a fourth,
+// sterile neutrino, with U = R34 R24 R14 U3 and no extra CP phases
+// they are applied on top of the three neutrino masses and mixing
+void Oscillator::SetSterile(double dm41, double s14, double s24, double s34)
+{
+	if (_dim < 4)
+		throw std::invalid_argument("Oscillator: sterile parameters need "
+				"at least 4 neutrinos");
+
+	_sterile = {{dm41, sqrt(s14), sqrt(s24), sqrt(s34)}};
+	if (dms.size())
+		dms(3) = dm41;
+	if (_sins.size())
+		SetPMNS_sin(_sins(0), _sins(1), _sins(2), _cp);
+
+	//reset lookup table
+	Reset();
 }
 
 Oscillator::masses Oscillator::GetHierarchy()
@@ -433,6 +1513,9 @@ Oscillator::masses Oscillator::GetHierarchy()
 
 void Oscillator::SetPMNS_sin(double s12, double s13, double s23, double cp) 
 {
+	_sins = Eigen::Vector3d(s12, s13, s23);
+	_cp = cp;
+
 	double c12 = sqrt(1 - s12*s12);
 	double c13 = sqrt(1 - s13*s13);
 	double c23 = sqrt(1 - s23*s23);
@@ -453,12 +1536,56 @@ void Oscillator::SetPMNS_sin(double s12, double s13, double s23, double cp)
 	   	-s12, 	c12,	0.0,
 		0.0,	0.0,	1.0;
 
+	Eigen::MatrixXcd pmns = Eigen::MatrixXcd::Identity(_dim, _dim);
+	pmns.topLeftCorner(3, 3) = U1 * U2 * U3;
+
+	// rotations of the sterile neutrino, R34 R24 R14
+	for (int i = 0; i < 3 && _dim > 3; ++i) {
+		double s4 = _sterile[1 + i];
+		double c4 = sqrt(1 - s4*s4);
+
+		Eigen::MatrixXd R4 = Eigen::MatrixXd::Identity(_dim, _dim);
+		R4(i, i) = c4;
+		R4(i, 3) = s4;
+		R4(3, i) = -s4;
+		R4(3, 3) = c4;
+		pmns = R4 * pmns;
+	}
+
 	_pmns = Eigen::MatrixXcd::Zero(2*_dim, 2*_dim);
 
 	// pmns matrix is 2*ndim X 2*ndim and contains both pmns and pmns*
-	_pmns.topLeftCorner(_dim, _dim) = U1 * U2 * U3;
+	_pmns.topLeftCorner(_dim, _dim) = pmns;
 	_pmns.bottomRightCorner(_dim, _dim) =
 		_pmns.topLeftCorner(_dim, _dim).conjugate();
+
+	// derivatives of the neutrino pmns matrix with respect to
+	// the sines squared of the mixing angles and the CP phase
+	// d/d(s²) = 1/(2s) d/ds, so they diverge for vanishing angles
+	Eigen::Matrix3cd dU1, dU2, dU3, dU2cp;
+
+	dU1 <<	0.0, 	0.0, 		0.0,
+		0.0, 	-s23/c23,	1.0,
+		0.0, 	-1.0, 		-s23/c23;
+
+	dU2 <<	-s13/c13,	0.0, 	dcp,
+		0.0, 		0.0,	0.0,
+		-1.0/dcp, 	0.0,	-s13/c13;
+
+	dU3 <<	-s12/c12, 	1.0,		0.0,
+		-1.0, 		-s12/c12,	0.0,
+		0.0,		0.0,		0.0;
+
+	const std::complex<double> ii(0, 1);
+	dU2cp << 0.0,			0.0, 	-ii*s13*dcp,
+		 0.0, 			0.0,	0.0,
+		 -ii*s13/dcp, 		0.0,	0.0;
+
+	_dpmns.resize(4);
+	_dpmns[0] = U1 * U2 * dU3 / (2 * s12);
+	_dpmns[1] = U1 * dU2 * U3 / (2 * s13);
+	_dpmns[2] = dU1 * U2 * U3 / (2 * s23);
+	_dpmns[3] = U1 * dU2cp * U3;
 }
 
 //passing sin squared
@@ -473,6 +1600,14 @@ void Oscillator::SetPMNS_angles(double t12, double t13, double t23, double cp)
 	SetPMNS_sin(std::sin(t12), std::sin(t13), std::sin(t23), cp);
 }
 
+void Oscillator::SetCP(double cp)
+{
+	if (!_sins.size())
+		throw std::logic_error("Oscillator: mixing angles must be set before the CP phase");
+
+	SetPMNS<Oscillator::sin>(_sins(0), _sins(1), _sins(2), cp);
+}
+
 Eigen::MatrixXcd Oscillator::PMNS()
 {
 	return _pmns.topLeftCorner(_dim, _dim);
@@ -482,3 +1617,13 @@ Eigen::VectorXd Oscillator::Masses()
 {
 	return dms;
 }
+
+Eigen::VectorXd Oscillator::Mixing()
+{
+	return _sins;
+}
+
+double Oscillator::CP()
+{
+	return _cp;
+}
@@ -0,0 +1,139 @@
+#include "physics/Oscillogram.h"
+
+Oscillogram::Oscillogram(double lemin, double lemax, int ne,
+			 double czmin, double czmax, int nz) :
+	_lemin(lemin),
+	_dle((lemax - lemin) / (ne - 1)),
+	_czmin(czmin),
+	_dcz((czmax - czmin) / (nz - 1)),
+	_ne(ne),
+	_nz(nz),
+	_dim(0)
+{
+	if (ne < 4 || nz < 4)
+		throw std::invalid_argument("Oscillogram: at least 4 nodes "
+				"are needed in each direction");
+}
+
+// the production height is the fixed one of the atmosphere
+// so the spread of heights is not included in the table
+void Oscillogram::Build(std::shared_ptr<Oscillator> osc, Atmosphere &atm)
+{
+	_dim = osc->Masses().size();
+	const int nn = _dim * _dim;
+
+	const Eigen::ArrayXd energies = Eigen::pow(10.,
+			Eigen::ArrayXd::LinSpaced(_ne, _lemin, _lemin + _dle * (_ne - 1)));
+
+	for (int sector = 0; sector < 2; ++sector)
+		_prob[sector].resize(_nz * _ne * nn);
+
+	for (int z = 0; z < _nz; ++z) {
+		osc->SetMatterProfile(atm.MatterProfile(_czmin + _dcz * z));
+		for (int sector = 0; sector < 2; ++sector) {
+			const Eigen::ArrayXXd prob = osc->ProbabilityMatrix
+				(Nu::Flavor(3 * sector), energies);
+			for (int e = 0; e < _ne; ++e)
+				for (int c = 0; c < nn; ++c)
+					_prob[sector][(z * _ne + e) * nn + c] = prob(e, c);
+		}
+	}
+}
+
+// cubic convolution (Catmull-Rom) weights, which interpolate the nodes
+// with continuous first derivative, the stencil is clamped at the edges
+void Oscillogram::Weights(double x, double x0, double dx, int n,
+			  std::array<int, 4> &idx, std::array<double, 4> &ww) const
+{
+	double pos = (x - x0) / dx;
+	int i = std::max(0, std::min(n - 2, int(std::floor(pos))));
+	double t = std::max(0., std::min(1., pos - i));
+
+	for (int k = 0; k < 4; ++k)
+		idx[k] = std::max(0, std::min(n - 1, i - 1 + k));
+
+	double t2 = t * t, t3 = t2 * t;
+	ww[0] = (-t3 + 2 * t2 - t) / 2.;
+	ww[1] = (3 * t3 - 5 * t2 + 2) / 2.;
+	ww[2] = (-3 * t3 + 4 * t2 + t) / 2.;
+	ww[3] = (t3 - t2) / 2.;
+}
+
+Eigen::MatrixXd Oscillogram::ProbabilityMatrix(Nu::Flavor nu, double energy,
+					       double cosz) const
+{
+	if (!_dim)
+		throw std::logic_error("Oscillogram: Build must be called first");
+
+	std::array<int, 4> ie, iz;
+	std::array<double, 4> we, wz;
+	Weights(std::log10(energy), _lemin, _dle, _ne, ie, we);
+	Weights(cosz, _czmin, _dcz, _nz, iz, wz);
+
+	const int nn = _dim * _dim;
+	const std::vector<double> &prob = _prob[nu / 3];
+
+	Eigen::MatrixXd pm = Eigen::MatrixXd::Zero(_dim, _dim);
+	for (int a = 0; a < 4; ++a)
+		for (int b = 0; b < 4; ++b)
+			pm += (wz[a] * we[b]) * Eigen::Map<const Eigen::MatrixXd>
+				(prob.data() + (iz[a] * _ne + ie[b]) * nn, _dim, _dim);
+
+	return pm;
+}
+
+double Oscillogram::Probability(Nu::Flavor in, Nu::Flavor out,
+				double energy, double cosz) const
+{
+	// neutrinos and antineutrinos do not mix
+	if (in / 3 != out / 3)
+		return 0.;
+
+	return ProbabilityMatrix(in, energy, cosz)(out % 3, in % 3);
+}
+
+Eigen::VectorXd Oscillogram::Nodes(Nu::Flavor in, Nu::Flavor out) const
+{
+	if (!_dim)
+		throw std::logic_error("Oscillogram: Build must be called first");
+
+	if (in / 3 != out / 3)
+		return Eigen::VectorXd::Zero(_nz * _ne);
+
+	// element (out, in) of each node, one every N x N values
+	const int nn = _dim * _dim;
+	return Eigen::Map<const Eigen::VectorXd, 0, Eigen::InnerStride<> >
+		(_prob[in / 3].data() + out % 3 + _dim * (in % 3), _nz * _ne,
+		 Eigen::InnerStride<>(nn));
+}
+
+// exact probabilities are computed with the batched oscillator
+// for the same parameters used to build the table
+double Oscillogram::ErrorBound(std::shared_ptr<Oscillator> osc, Atmosphere &atm,
+			       double &rms)
+{
+	const Eigen::ArrayXd lens = Eigen::ArrayXd::LinSpaced(_ne - 1,
+			_lemin + _dle / 2., _lemin + _dle * (_ne - 1.5));
+	const Eigen::ArrayXd energies = Eigen::pow(10., lens);
+
+	double err = 0;
+	rms = 0;
+	for (int z = 0; z < _nz - 1; ++z) {
+		double cosz = _czmin + _dcz * (z + 0.5);
+		osc->SetMatterProfile(atm.MatterProfile(cosz));
+		for (int sector = 0; sector < 2; ++sector) {
+			Nu::Flavor nu = Nu::Flavor(3 * sector);
+			const Eigen::ArrayXXd prob = osc->ProbabilityMatrix(nu, energies);
+			for (int e = 0; e < energies.size(); ++e) {
+				Eigen::MatrixXd diff = ProbabilityMatrix(nu, energies(e), cosz);
+				diff -= Eigen::Map<const Eigen::MatrixXd>
+					(prob.row(e).eval().data(), _dim, _dim);
+				err = std::max(err, diff.cwiseAbs().maxCoeff());
+				rms += diff.squaredNorm();
+			}
+		}
+	}
+
+	rms = std::sqrt(rms / (2. * (_nz - 1) * energies.size() * _dim * _dim));
+	return err;
+}
@@ -170,6 +170,31 @@ std::map<std::string, double> ParameterSpace::GetEntry(int n)
 	return vars;
 }
 
+// in GetEntry the first parameter, CP, is the slowest, so the n-th point
+// with fastest varied first is found by moving the index of fastest
+// after the indices of the other parameters, which keep their order
+int ParameterSpace::GetOrderedEntry(int n, const std::string &fastest)
+{
+	if (n < 0 || n >= GetEntries())
+		throw std::invalid_argument("ParameterSpace: requested point that does not exist");
+
+	auto in = _binning.find(fastest);
+	if (in == _binning.end())
+		return n;
+
+	// q is the number of points of the parameters after fastest
+	int q = 1;
+	Binning::reverse_iterator ir;
+	for (ir = _binning.rbegin(); ir->first != fastest; ++ir)
+		q *= ir->second.size();
+
+	int nf = in->second.size();
+	int a = n % nf;
+	n /= nf;
+
+	return (n / q) * q * nf + a * q + n % q;
+}
+
 void ParameterSpace::GetNominal(double &M12, double &M23,
 			      double &S12, double &S13, double &S23, double &dCP)
 {
@@ -12,6 +12,11 @@ Sample::Sample(const std::string &card) :
 		kVerbosity = 0;
 	if (!cd.Get("stats", _stats))
 		_stats = 1.0;
+	if (!cd.Get("cp_harmonics", kHarmonics))
+		kHarmonics = false;
+	if (!cd.Get("harmonics_cache", _harm_cache))
+		_harm_cache = 16;
+	_harm_calls = _harm_hits = 0;
 }
 
 Sample::Sample(const CardDealer &cd) :
@@ -23,6 +28,11 @@ Sample::Sample(const CardDealer &cd) :
 		kVerbosity = 0;
 	if (!cd.Get("stats", _stats))
 		_stats = 1.0;
+	if (!cd.Get("cp_harmonics", kHarmonics))
+		kHarmonics = false;
+	if (!cd.Get("harmonics_cache", _harm_cache))
+		_harm_cache = 16;
+	_harm_calls = _harm_hits = 0;
 }
 
 Sample::Sample(CardDealer *cd) :
@@ -34,6 +44,11 @@ Sample::Sample(CardDealer *cd) :
 		kVerbosity = 0;
 	if (!cd->Get("stats", _stats))
 		_stats = 1.0;
+	if (!cd->Get("cp_harmonics", kHarmonics))
+		kHarmonics = false;
+	if (!cd->Get("harmonics_cache", _harm_cache))
+		_harm_cache = 16;
+	_harm_calls = _harm_hits = 0;
 }
 
 void Sample::Load(const CardDealer &cd, std::string process) {
@@ -140,6 +155,83 @@ void Sample::DefineBinning(bool zerosuppress) {
 
 // compress all samples into one vector without zeros
 Eigen::VectorXd Sample::ConstructSamples(std::shared_ptr<Oscillator> osc) {
+	if (kHarmonics && osc)
+		return Harmonics(osc) * HarmonicBasis(osc->CP());
+
+	return CollateSamples(osc);
+}
+
+// with three neutrinos the amplitudes are linear in exp(±i dCP) for any
+// matter profile, because the matter potential commutes with the CP phase
+// and the 23 rotation, so any oscillated spectrum is exactly
+//	c0 + c1 cos dCP + s1 sin dCP + c2 cos 2dCP + s2 sin 2dCP
+// and the coefficients are found from five values of dCP
+// this needs the five evaluations to use the same matter profiles, so
+// random production heights must be the same at every build, as they
+// are with the per event streams of AtmoSample
+// this does not hold with sterile neutrinos, whose rotations and neutral
+// current potential do not commute with the CP phase
+// returns a matrix with one column per coefficient, as in HarmonicBasis
+Eigen::MatrixXd Sample::Harmonics(std::shared_ptr<Oscillator> osc) {
+	if (osc->Masses().size() > 3)
+		throw std::invalid_argument("Sample: dCP harmonics are exact only "
+				"with three neutrinos, disable cp_harmonics");
+
+	Eigen::VectorXd ms = osc->Masses(), ss = osc->Mixing();
+	std::vector<double> key(ms.data(), ms.data() + ms.size());
+	key.insert(key.end(), ss.data(), ss.data() + ss.size());
+
+	++_harm_calls;
+	auto ih = _harmonics.find(key);
+	if (ih != _harmonics.end()) {
+		++_harm_hits;
+		// most recently used at the back
+		_harm_order.splice(_harm_order.end(), _harm_order, ih->second.second);
+		return ih->second.first;
+	}
+
+	if (kVerbosity > 1)
+		std::cout << "Sample: computing dCP harmonics, hit rate "
+			  << _harm_hits << " / " << _harm_calls << "\n";
+
+	const int nh = 5;
+	double cp = osc->CP();
+
+	Eigen::MatrixXd spectra(_nBin, nh), basis(nh, nh);
+	for (int k = 0; k < nh; ++k) {
+		double phase = 2 * Const::pi * k / nh;
+		basis.row(k) = HarmonicBasis(phase).transpose();
+
+		osc->SetCP(phase);
+		spectra.col(k) = CollateSamples(osc);
+	}
+	osc->SetCP(cp);	// restore oscillator
+
+	if (_harm_cache && _harmonics.size() >= _harm_cache) {
+		_harmonics.erase(_harm_order.front());
+		_harm_order.pop_front();
+	}
+
+	_harm_order.push_back(key);
+	ih = _harmonics.emplace(key, std::make_pair(spectra * basis.transpose().inverse(),
+						    std::prev(_harm_order.end()))).first;
+	return ih->second.first;
+}
+
+Eigen::VectorXd Sample::HarmonicBasis(double cp) {
+	Eigen::VectorXd basis(5);
+	basis << 1, std::cos(cp), std::sin(cp), std::cos(2 * cp), std::sin(2 * cp);
+	return basis;
+}
+
+void Sample::SetHarmonics(bool harm) {
+	kHarmonics = harm;
+	_harmonics.clear();
+	_harm_order.clear();
+	_harm_calls = _harm_hits = 0;
+}
+
+Eigen::VectorXd Sample::CollateSamples(std::shared_ptr<Oscillator> osc) {
 
 	// build samples return the full spectrum (zero bins included)
 	std::unordered_map<std::string, Eigen::VectorXd> samples = BuildSamples(osc);
@@ -157,6 +249,27 @@ Eigen::VectorXd Sample::ConstructSamples(std::shared_ptr<Oscillator> osc) {
 	return _stats * vect;
 }
 
+// same as above for the derivatives of the spectra with respect to
+// the oscillation parameters M12, M23, S12, S13, S23, and dCP
+Eigen::MatrixXd Sample::ConstructJacobian(std::shared_ptr<Oscillator> osc) {
+
+	std::unordered_map<std::string, Eigen::MatrixXd> jacobians = BuildJacobians(osc);
+	Eigen::MatrixXd jac = Eigen::MatrixXd::Zero(_nBin, 6);
+
+	for (const std::string &it : _type) {
+		if (!jacobians.count(it))
+			continue;
+
+		int i = _offset[it];
+		for (int n : _binpos[it]) {
+			jac.row(i) = jacobians[it].row(n);
+			++i;
+		}
+	}
+
+	return _stats * jac;
+}
+
 std::vector<double> Sample::GetErecoBins(std::string it) {
 	if (_type.find(it) == _type.end())
 		throw std::invalid_argument("Sample: unknown sample type " + it);